@@ -0,0 +1,333 @@
+//
+// Instrumented cv::MatAllocator counting allocations, with optional pooling
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+
+struct AllocationStats {
+    size_t allocations = 0;     // buffers handed out
+    size_t bytes = 0;           // their total size
+    size_t peak_live_bytes = 0; // most bytes held at once
+    size_t pool_hits = 0;       // allocations served from a pool
+};
+
+struct AllocatorParams {
+    bool pool = false;                      // recycle freed buffers by size class, four per power of two
+    size_t min_pooled = 4 << 10;            // smallest size class, smaller buffers are rounded up to it
+    size_t max_pooled = 64 << 20;           // largest size class, larger buffers are not pooled
+    size_t max_pool_bytes = 256 << 20;      // cap on idle bytes kept across all classes
+};
+
+// Open while an operation runs to account the cv::Mat allocations this
+// thread makes meanwhile; scopes nest. Allocations made on other threads,
+// e.g. inside cv::parallel_for_ workers, are not attributed to the scope,
+// and a scope's live bytes only drop when a buffer it allocated is freed,
+// not when it frees older buffers or ones from other threads.
+class AllocationScope {
+
+    friend class CountingAllocator;
+
+    const char* name;
+    AllocationScope* parent = nullptr;
+    AllocationStats stats;
+    int64_t live = 0;
+    uintptr_t serial = 0;   // tag of buffers allocated directly in this scope
+    bool active;
+
+    static AllocationScope*& current() {
+        thread_local AllocationScope* scope = nullptr;
+        return scope;
+    }
+
+    // Buffer tags: the allocating thread's number in the high half, the
+    // scope's number on that thread in the low half, 0 for no scope. On a
+    // thread, scopes opened while s is open, and only those, nest in s and
+    // have numbers from s's up; so a tag belongs to s or a scope within it
+    // exactly when it is from this thread and at least s's number.
+    static constexpr int tag_shift = sizeof(uintptr_t) * 4;
+
+    static uintptr_t thread_tag() {
+        static std::atomic<uintptr_t> threads{0};
+        thread_local uintptr_t tag = (threads.fetch_add(1, std::memory_order_relaxed) + 1) << tag_shift;
+        return tag;
+    }
+
+    static uintptr_t next_serial() {
+        thread_local uintptr_t scopes = 0;
+        return thread_tag() | (++scopes & ((uintptr_t(1) << tag_shift) - 1));
+    }
+
+    static uintptr_t current_tag() {
+        AllocationScope* scope = current();
+        return scope ? scope->serial : 0;
+    }
+
+    void on_allocate(const size_t size, const bool pooled) {
+        for (AllocationScope* s = this; s; s = s->parent) {
+            ++s->stats.allocations;
+            s->stats.bytes += size;
+            s->stats.pool_hits += pooled;
+            s->live += size;
+            s->stats.peak_live_bytes = std::max<size_t>(s->stats.peak_live_bytes, std::max<int64_t>(s->live, 0));
+        }
+    }
+
+    // a buffer tagged tag was freed on this thread
+    void on_deallocate(const size_t size, const uintptr_t tag) {
+        if (!tag || (tag >> tag_shift) != (serial >> tag_shift)) return;
+        for (AllocationScope* s = this; s; s = s->parent)
+            if (tag >= s->serial) s->live -= size;
+    }
+
+public:
+
+    explicit AllocationScope(const char* _name);
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    // what this scope has counted so far
+    const AllocationStats& so_far() const { return stats; }
+};
+
+// A cv::MatAllocator doing what OpenCV's standard one does, fastMalloc and
+// fastFree, while counting every buffer. With pooling on, freed buffers are
+// kept in size classes a quarter of a power of two apart and handed out
+// again, so steady-state pipelines stop going to the system allocator per
+// frame.
+class CountingAllocator : public cv::MatAllocator {
+
+    // MatAllocator's interface is const, the counters change regardless
+    mutable std::atomic<size_t> allocations{0};
+    mutable std::atomic<size_t> bytes{0};
+    mutable std::atomic<size_t> pool_hits{0};
+    mutable std::atomic<int64_t> live{0};
+    mutable std::atomic<int64_t> peak{0};
+
+    std::atomic<bool> pooling{false};
+    AllocatorParams params;
+    mutable std::mutex pool_mutex;
+    mutable std::map<int, std::vector<void*>> pools;        // size class -> idle blocks
+    mutable size_t pooled_bytes = 0;
+
+    mutable std::mutex report_mutex;
+    std::map<std::string, AllocationStats> by_scope;
+
+    // Size classes split every power of two in four, 2^k + j * 2^(k-2) for
+    // j = 0..3, so a block wastes at most a fifth of itself; class 4k + j,
+    // 0 standing for not pooled
+    static size_t class_bytes(const int cls) {
+        const int k = cls / 4;
+        return (size_t(1) << k) + size_t(cls % 4) * (size_t(1) << (k - 2));
+    }
+
+    // the smallest class holding size, 0 when it is not pooled
+    int size_class(size_t size) const {
+        if (!pooling.load(std::memory_order_relaxed) || size > params.max_pooled) return 0;
+        size = std::max<size_t>({size, params.min_pooled, 4});
+        int k = 2;
+        while ((size_t(1) << (k + 1)) <= size) ++k;
+        const size_t quarter = size_t(1) << (k - 2);
+        const int j = int((size - (size_t(1) << k) + quarter - 1) / quarter);
+        return j == 4 ? 4 * (k + 1) : 4 * k + j;
+    }
+
+    // a block for size bytes; a pooled class is recorded in cls so the
+    // block goes back to the right pool even if the parameters change
+    void* take(const size_t size, int& cls, bool& pooled) const {
+        pooled = false;
+        cls = size_class(size);
+        if (cls) {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            auto it = pools.find(cls);
+            if (it != pools.end() && !it->second.empty()) {
+                void* p = it->second.back();
+                it->second.pop_back();
+                pooled_bytes -= class_bytes(cls);
+                pooled = true;
+                return p;
+            }
+        }
+        // allocate the whole class so the block can serve any request in it
+        return cv::fastMalloc(cls ? class_bytes(cls) : size);
+    }
+
+    void give_back(void* p, const int cls) const {
+        if (cls && pooling.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (pooled_bytes + class_bytes(cls) <= params.max_pool_bytes) {
+                pools[cls].push_back(p);
+                pooled_bytes += class_bytes(cls);
+                return;
+            }
+        }
+        cv::fastFree(p);
+    }
+
+    void count_allocation(const size_t size, const bool pooled) const {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        if (pooled) pool_hits.fetch_add(1, std::memory_order_relaxed);
+        const int64_t now = live.fetch_add(size, std::memory_order_relaxed) + int64_t(size);
+        int64_t prev = peak.load(std::memory_order_relaxed);
+        while (now > prev && !peak.compare_exchange_weak(prev, now, std::memory_order_relaxed)) {}
+        if (AllocationScope* scope = AllocationScope::current()) scope->on_allocate(size, pooled);
+    }
+
+    void count_deallocation(const size_t size, const uintptr_t tag) const {
+        live.fetch_sub(size, std::memory_order_relaxed);
+        if (AllocationScope* scope = AllocationScope::current()) scope->on_deallocate(size, tag);
+    }
+
+public:
+
+    // same layout as cv::StdMatAllocator
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+                           cv::AccessFlag, cv::UMatUsageFlags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP) {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                } else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        int cls = 0;
+        bool pooled = false;
+        uchar* data = data0 ? static_cast<uchar*>(data0) : static_cast<uchar*>(take(total, cls, pooled));
+        cv::UMatData* u = new cv::UMatData(this);
+        u->data = u->origdata = data;
+        u->size = total;
+        u->allocatorFlags_ = cls;
+        // CPU buffers leave userdata unused, it carries the allocating scope
+        u->userdata = reinterpret_cast<void*>(AllocationScope::current_tag());
+        if (data0) u->flags |= cv::UMatData::USER_ALLOCATED;
+        else count_allocation(total, pooled);
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const override {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) return;
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            count_deallocation(u->size, reinterpret_cast<uintptr_t>(u->userdata));
+            give_back(u->origdata, u->allocatorFlags_);
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+
+    // set before the pipeline runs, not while other threads allocate
+    void set_params(const AllocatorParams& _params) {
+        release_pools();
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        params = _params;
+        pooling.store(params.pool, std::memory_order_relaxed);
+    }
+
+    // hand every idle pooled block back to the system
+    void release_pools() {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        for (auto& [size, blocks] : pools)
+            for (void* p : blocks) cv::fastFree(p);
+        pools.clear();
+        pooled_bytes = 0;
+    }
+
+    // totals since install, peak_live_bytes since install or reset_peak
+    AllocationStats totals() const {
+        AllocationStats ret;
+        ret.allocations = allocations.load();
+        ret.bytes = bytes.load();
+        ret.pool_hits = pool_hits.load();
+        ret.peak_live_bytes = size_t(std::max<int64_t>(peak.load(), 0));
+        return ret;
+    }
+
+    int64_t live_bytes() const { return live.load(); }
+    void reset_peak() { peak.store(live.load()); }
+
+    // merge a finished scope into the per-name report
+    void add_to_report(const std::string& name, const AllocationStats& stats) {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        AllocationStats& total = by_scope[name];
+        total.allocations += stats.allocations;
+        total.bytes += stats.bytes;
+        total.pool_hits += stats.pool_hits;
+        total.peak_live_bytes = std::max(total.peak_live_bytes, stats.peak_live_bytes);
+    }
+
+    std::map<std::string, AllocationStats> report() const {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        return by_scope;
+    }
+
+    void clear_report() {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        by_scope.clear();
+    }
+};
+
+inline std::atomic<CountingAllocator*>& installed_allocator_slot() {
+    static std::atomic<CountingAllocator*> slot{nullptr};
+    return slot;
+}
+
+// the installed allocator, nullptr until install_counting_allocator
+inline CountingAllocator* counting_allocator() {
+    return installed_allocator_slot().load(std::memory_order_acquire);
+}
+
+// Make the counting allocator the default for every cv::Mat allocated from
+// now on. It is never destroyed, since buffers it handed out may outlive
+// any owner; calling again only updates the parameters.
+inline CountingAllocator& install_counting_allocator(const AllocatorParams& params = AllocatorParams()) {
+    static CountingAllocator* allocator = new CountingAllocator();
+    allocator->set_params(params);
+    cv::Mat::setDefaultAllocator(allocator);
+    installed_allocator_slot().store(allocator, std::memory_order_release);
+    return *allocator;
+}
+
+inline AllocationScope::AllocationScope(const char* _name) : name(_name), active(counting_allocator() != nullptr) {
+    if (!active) return;
+    serial = next_serial();
+    parent = current();
+    current() = this;
+}
+
+inline AllocationScope::~AllocationScope() {
+    if (!active) return;
+    current() = parent;
+    counting_allocator()->add_to_report(name, stats);
+}
+
+inline std::ostream& operator<<(std::ostream& os, const AllocationStats& stats) {
+    return os << stats.allocations << " allocations, "
+              << stats.bytes / 1024.0 / 1024.0 << " MiB, peak live "
+              << stats.peak_live_bytes / 1024.0 / 1024.0 << " MiB, "
+              << stats.pool_hits << " from pool";
+}
@@ -0,0 +1,101 @@
+//
+// Fixed-point alpha compositing of overlays onto frames
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "CpuDispatch.h"
+#include "Executor.h"
+
+
+struct BlendParams {
+    double weight = 0.5;        // overlay opacity, scales the per-pixel alpha when there is one
+    cv::Point origin;           // where the overlay's top-left corner lands in the frame
+};
+
+// Alpha weights are 8.8 fixed point in [0, 256], so d * (256 - a) + s * a
+// stays within 16 bits and the row loops below vectorise to 16-bit lanes,
+// built per ISA and picked at run time through CpuDispatch.h.
+static inline ushort blend_alpha(const double weight) {
+    return ushort(std::lround(std::min(std::max(weight, 0.0), 1.0) * 256));
+}
+
+// one row, every byte blended with the same alpha
+static IMGUTIL_ALWAYS_INLINE void blend_row_const_impl(uchar* d, const uchar* s, const int n, const ushort a) {
+    const ushort ia = 256 - a;
+    for (int i = 0; i < n; ++i)
+        d[i] = uchar((d[i] * ia + s[i] * a + 128) >> 8);
+}
+IMGUTIL_KERNEL_VARIANTS(blend_row_const, (uchar* d, const uchar* s, const int n, const ushort a), (d, s, n, a))
+
+// one row, a separate alpha per byte
+static IMGUTIL_ALWAYS_INLINE void blend_row_impl(uchar* d, const uchar* s, const ushort* alpha, const int n) {
+    for (int i = 0; i < n; ++i)
+        d[i] = uchar((d[i] * (256 - alpha[i]) + s[i] * alpha[i] + 128) >> 8);
+}
+IMGUTIL_KERNEL_VARIANTS(blend_row, (uchar* d, const uchar* s, const ushort* alpha, const int n), (d, s, alpha, n))
+
+// Blend overlay into frame in place, only over the part of the frame the
+// overlay covers once placed at params.origin, so nothing is resized or
+// copied at frame size. Per-pixel alpha comes from mask (8-bit, overlay
+// sized) and/or a BGRA overlay's alpha channel, scaled by params.weight;
+// without either every pixel uses params.weight.
+static void blend_into(cv::Mat& frame, const cv::Mat& overlay, const BlendParams& params = BlendParams(), const cv::Mat& mask = cv::Mat()) {
+    const int cn = frame.channels();
+    const bool src_alpha = overlay.channels() == cn + 1;
+    CV_Assert(frame.depth() == CV_8U && overlay.depth() == CV_8U);
+    CV_Assert(overlay.channels() == cn || (cn == 3 && src_alpha));
+    CV_Assert(mask.empty() || (mask.type() == CV_8UC1 && mask.size() == overlay.size()));
+
+    const cv::Rect placed(params.origin, overlay.size());
+    const cv::Rect roi = placed & cv::Rect(cv::Point(), frame.size());
+    if (roi.empty()) return;
+    const cv::Point src_tl = roi.tl() - placed.tl();
+
+    const ushort weight = blend_alpha(params.weight);
+    const bool per_pixel = src_alpha || !mask.empty();
+    if (!per_pixel && weight == 0) return;
+
+    // 8-bit alpha to fixed point, with the global weight folded in
+    ushort lut[256];
+    for (int v = 0; v < 256; ++v)
+        lut[v] = ushort((v * weight + 127) / 255);
+
+    const int n = roi.width * cn;
+    shared_executor().parallel_for(cv::Range(0, roi.height), [&](const cv::Range& range) {
+        std::vector<ushort> alpha(per_pixel ? n : 0);
+        std::vector<uchar> color(src_alpha ? n : 0);
+
+        for (int y = range.start; y < range.end; ++y) {
+            uchar* d = frame.ptr<uchar>(roi.y + y) + roi.x * cn;
+            const uchar* s = overlay.ptr<uchar>(src_tl.y + y) + src_tl.x * overlay.channels();
+
+            if (!per_pixel) {
+                blend_row_const(d, s, n, weight);
+                continue;
+            }
+
+            const uchar* m = mask.empty() ? nullptr : mask.ptr<uchar>(src_tl.y + y) + src_tl.x;
+            for (int x = 0; x < roi.width; ++x) {
+                ushort a;
+                if (src_alpha) {
+                    const uchar* p = s + 4 * x;
+                    color[3 * x] = p[0];
+                    color[3 * x + 1] = p[1];
+                    color[3 * x + 2] = p[2];
+                    a = m ? ushort((lut[m[x]] * p[3] + 127) / 255) : lut[p[3]];
+                } else {
+                    a = lut[m[x]];
+                }
+                for (int c = 0; c < cn; ++c) alpha[x * cn + c] = a;
+            }
+            blend_row(d, src_alpha ? color.data() : s, alpha.data(), n);
+        }
+    });
+}
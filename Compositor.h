@@ -0,0 +1,119 @@
+//
+// Overlay and picture-in-picture compositing onto streams of frames
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <optional>
+#include <vector>
+
+#include "Warp.h"
+#include "Blend.h"
+#include "Resize.h"
+#include "FrameFilter.h"
+
+
+struct OverlayParams {
+    double weight = 1.0;            // opacity, scales mask and alpha channel when present
+    cv::Rect placement;             // overlay scaled into this rectangle; empty = own size at (0, 0)
+
+    // when 4 points are given the overlay is projected onto this quad of the
+    // frame instead, as Image::proj_img does; overlay_quad picks the part of
+    // the overlay to project, its corners when empty
+    std::vector<cv::Point> quad;
+    std::vector<cv::Point> overlay_quad;
+
+    cv::Mat mask;                   // optional 8-bit alpha in overlay coordinates
+};
+
+// Composites overlays of one size onto frames of one size. The placement,
+// the warp tables and the alpha mask are worked out once at construction
+// and cover only the destination ROI, so each frame costs a resize or
+// remap of the overlay to ROI size (none for a still prepared once) and a
+// single blend over the ROI.
+class Compositor {
+
+    OverlayParams params;
+    cv::Rect roi;           // destination region in frame coordinates
+    Warp warp;              // overlay to ROI, projected placements only
+    cv::Mat mask;           // ROI sized alpha, empty when the overlay is opaque
+    cv::Mat patch;          // overlay prepared for the ROI
+
+public:
+
+    Compositor() = default;
+    Compositor(const OverlayParams& _params, const cv::Size& overlay_size, const cv::Size& frame_size) : params(_params) {
+        const cv::Rect bounds(cv::Point(), frame_size);
+
+        if (params.quad.size() == 4) {
+            std::vector<cv::Point> src = params.overlay_quad;
+            if (src.size() != 4)
+                src = {
+                    cv::Point(0, 0),
+                    cv::Point(overlay_size.width, 0),
+                    cv::Point(overlay_size.width, overlay_size.height),
+                    cv::Point(0, overlay_size.height),
+                };
+            roi = cv::boundingRect(params.quad) & bounds;
+            if (roi.empty()) return;
+
+            // warp straight into the ROI; an opaque overlay still needs the
+            // quad's coverage as its mask, which warping a full mask yields
+            const cv::Matx33d shift(1, 0, -roi.x, 0, 1, -roi.y, 0, 0, 1);
+            const cv::Mat h = cv::Mat(shift) * cv::findHomography(src, params.quad);
+            warp = Warp(h, roi.size());
+            warp.apply(params.mask.empty() ? cv::Mat(overlay_size, CV_8UC1, cv::Scalar(255)) : params.mask, mask);
+        } else {
+            roi = params.placement.empty() ? cv::Rect(cv::Point(), overlay_size) : params.placement;
+            if (!params.mask.empty()) {
+                ResizeParams nearest;
+                nearest.policy = ResizePolicy::NEAREST;
+                resize_image(params.mask, mask, roi.size(), nearest);
+            }
+        }
+    }
+
+    bool empty() const { return roi.empty(); }
+
+    // bring overlay to ROI size, warped or scaled; keep the result with
+    // prepared() to composite a still onto many frames
+    void prepare(const cv::Mat& overlay) {
+        if (roi.empty()) return;
+        if (!warp.empty()) {
+            warp.apply(overlay, patch);
+        } else {
+            ResizeParams params;
+            params.cache = false;
+            resize_image(overlay, patch, roi.size(), params);
+        }
+    }
+
+    // blend the last prepared overlay into frame
+    void apply(cv::Mat& frame) const {
+        if (roi.empty() || patch.empty()) return;
+        BlendParams blend;
+        blend.weight = params.weight;
+        blend.origin = roi.tl();
+        blend_into(frame, patch, blend, mask);
+    }
+
+    void composite(cv::Mat& frame, const cv::Mat& overlay) {
+        prepare(overlay);
+        apply(frame);
+    }
+};
+
+// composite a still overlay onto every frame; the compositor is built on the
+// first frame and the overlay prepared once, later frames only blend
+static FrameFilter overlay_filter(const cv::Mat& overlay, const OverlayParams& params = OverlayParams()) {
+    return [=, compositor = std::optional<Compositor>()](const cv::Mat& in, cv::Mat& out) mutable {
+        if (!compositor) {
+            compositor.emplace(params, overlay.size(), in.size());
+            compositor->prepare(overlay);
+        }
+        in.copyTo(out);
+        compositor->apply(out);
+    };
+}
@@ -0,0 +1,124 @@
+//
+// Runtime selection between ISA-specific builds of the hand-written kernels
+//
+
+#pragma once
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+
+// Dispatched kernels: the fixed-point blend rows (Blend.h), the 8-bit
+// threshold rows (ImageView.h) and the NMS IoU row (NMS.h), all straight
+// loops that wider vectors speed up. Table lookups (cv::LUT style kernels,
+// ThresholdEngine's fused gray-and-LUT pass) and the threshold histograms
+// are left out: their loads and increments go to data-dependent addresses,
+// which no level here vectorises (there is no byte gather or scatter), so
+// every variant would be the same scalar loop.
+
+// GCC and Clang on x86 can compile one function several times for different
+// instruction sets in a single translation unit and tell at run time which
+// of them the host supports; elsewhere every level runs the generic build
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define IMGUTIL_X86_DISPATCH 1
+#else
+#define IMGUTIL_X86_DISPATCH 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define IMGUTIL_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define IMGUTIL_ALWAYS_INLINE inline
+#endif
+
+enum class CpuLevel {
+    GENERIC = 0,    // whatever the build flags target
+    AVX2 = 1,       // AVX2 + FMA, the older fleet
+    AVX512 = 2      // AVX-512 F + BW, 512-bit lanes for bytes and words
+};
+
+static const char* cpu_level_name(const CpuLevel level) {
+    switch (level) {
+        case CpuLevel::AVX512: return "avx512";
+        case CpuLevel::AVX2: return "avx2";
+        default: return "generic";
+    }
+}
+
+// the best level this host supports
+static CpuLevel detected_cpu_level() {
+#if IMGUTIL_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return CpuLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return CpuLevel::AVX2;
+#endif
+    return CpuLevel::GENERIC;
+}
+
+// every level up to the detected one, lowest first
+static std::vector<CpuLevel> supported_cpu_levels() {
+    std::vector<CpuLevel> ret;
+    for (int l = 0; l <= int(detected_cpu_level()); ++l) ret.push_back(CpuLevel(l));
+    return ret;
+}
+
+// IMGUTIL_CPU_LEVEL=generic|avx2|avx512 caps the level used, e.g. to compare
+// against the older fleet on a new host; it never raises it past what the
+// host supports
+static CpuLevel cpu_level_from_env() {
+    const CpuLevel detected = detected_cpu_level();
+    const char* env = std::getenv("IMGUTIL_CPU_LEVEL");
+    if (!env) return detected;
+
+    const std::string name(env);
+    CpuLevel wanted = detected;
+    if (name == "generic") wanted = CpuLevel::GENERIC;
+    else if (name == "avx2") wanted = CpuLevel::AVX2;
+    else if (name == "avx512") wanted = CpuLevel::AVX512;
+    else std::cerr << "IMGUTIL_CPU_LEVEL: unknown level " << name << ", using " << cpu_level_name(detected) << std::endl;
+
+    if (int(wanted) > int(detected))
+        std::cerr << "IMGUTIL_CPU_LEVEL: " << name << " not supported here, using " << cpu_level_name(detected) << std::endl;
+    return CpuLevel(std::min(int(wanted), int(detected)));
+}
+
+inline CpuLevel& cpu_level_storage() {
+    static CpuLevel level = cpu_level_from_env();
+    return level;
+}
+
+// the level kernels dispatch on, chosen once at startup
+inline CpuLevel cpu_level() { return cpu_level_storage(); }
+
+// switch levels, clamped to what the host supports; for benchmarking the
+// variants against each other, not for use while kernels run on other threads
+inline void set_cpu_level(const CpuLevel level) {
+    cpu_level_storage() = CpuLevel(std::min(int(level), int(detected_cpu_level())));
+}
+
+// Stamp out generic, AVX2 and AVX-512 builds of a kernel from one always
+// inlined body `name##_impl`, plus `name` dispatching on cpu_level(). The
+// body is plain C++; each build is the compiler vectorising it for that ISA.
+#if IMGUTIL_X86_DISPATCH
+#define IMGUTIL_KERNEL_VARIANTS(name, params, args)                             \
+    static void name##_generic params { name##_impl args; }                    \
+    __attribute__((target("avx2,fma")))                                         \
+    static void name##_avx2 params { name##_impl args; }                       \
+    __attribute__((target("avx512f,avx512bw")))                                 \
+    static void name##_avx512 params { name##_impl args; }                     \
+    static inline void name params {                                            \
+        switch (cpu_level()) {                                                  \
+            case CpuLevel::AVX512: name##_avx512 args; return;                  \
+            case CpuLevel::AVX2: name##_avx2 args; return;                      \
+            default: name##_generic args; return;                               \
+        }                                                                       \
+    }
+#else
+#define IMGUTIL_KERNEL_VARIANTS(name, params, args)                             \
+    static inline void name params { name##_impl args; }
+#endif
@@ -0,0 +1,465 @@
+//
+// YOLOv5 object detection shared by Image and Video
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+
+#include "NMS.h"
+#include "DnnConfig.h"
+#include "Trace.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+
+struct ModelShapeErr {};
+
+struct Detection {
+    int labelId;
+    float confidence;
+    cv::Rect box;
+};
+
+struct DetectorParams {
+    std::string model_path = "model/yolov5s.onnx";
+    std::string classes_path = "model/classes.txt";
+    DnnConfig dnn = DnnConfig::from_env();  // backend, target and threads
+    bool validate_model = false;        // run one pass at load and check the output shape
+    int input_width = 640;              // network input size
+    int input_height = 640;
+    float score_threshold = 0.2;
+    float nms_threshold = 0.4;
+    float confidence_threshold = 0.4;
+
+    int nms_top_k = 0;                  // per class candidates entering suppression, 0 = all
+    bool class_aware_nms = true;        // overlapping objects of different classes both survive
+    bool soft_nms = false;              // decay overlapping scores instead of dropping boxes
+
+    // pad frames to their own aspect (sides rounded up to 32) instead of a
+    // square, saving the padding compute; needs a dynamic-shape export
+    bool rect_input = false;
+
+    // slice frames larger than tile_size into overlapping square tiles so
+    // small objects keep their resolution; 0 turns tiling off
+    int tile_size = 0;
+    float tile_overlap = 0.2;
+    bool tile_full_frame = true;        // also run the whole frame, for objects larger than a tile
+
+    bool operator==(const DetectorParams&) const = default;
+};
+
+// start-up costs of a Detector, in milliseconds, -1 until measured
+struct DetectorMetrics {
+    double load_ms = -1;                // reading the model and building the net
+    double warm_up_ms = -1;             // dummy passes run by warm_up()
+    double ready_ms = -1;               // load plus warm-up, without idle time between them
+    double first_detection_ms = -1;     // latency of the first real detect() or detect_batch()
+};
+
+// draw labelled boxes for detections onto frame
+static void draw_detections(const std::vector<Detection>& output, cv::Mat& frame, const std::vector<std::string>& labels) {
+    const std::vector<cv::Scalar> colors = {cv::Scalar(255, 255, 0), cv::Scalar(0, 255, 0), cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 0)};
+    for (const Detection& detection : output){
+        const auto box = detection.box;
+        const auto color = colors[detection.labelId % colors.size()];
+        cv::rectangle(frame, box, color, 3);
+        cv::rectangle(frame, cv::Point(box.x, box.y - 20), cv::Point(box.x + box.width, box.y), color, cv::FILLED);
+        cv::putText(frame, labels[detection.labelId].c_str(), cv::Point(box.x, box.y - 5), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 0));
+    }
+}
+
+// Loads a YOLOv5 ONNX export once and runs it on frames. Not thread-safe:
+// one Detector per thread, or share one behind a lock.
+class Detector {
+
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point created = Clock::now();
+    DetectorMetrics stats;
+    DetectorParams params;
+    cv::dnn::Net net;
+    std::vector<std::string> labels;
+    std::vector<std::string> output_names;
+    bool batch_ok = true;   // cleared when the export rejects batches > 1
+
+    // network input prepared from an image, and the way back
+    struct Letterbox {
+        cv::Mat input;      // image padded at the right/bottom to the aspect of net_size
+        cv::Size net_size;
+        float x_factor;     // network pixels to image pixels
+        float y_factor;
+        cv::Point offset;   // position of the image within the frame
+        int frame = 0;      // which frame of a batch of frames it belongs to
+    };
+
+    static int round_up32(const int v) { return (v + 31) / 32 * 32; }
+
+    static double elapsed_ms(const Clock::time_point& since) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    }
+
+    void note_detection(const Clock::time_point& start) {
+        if (stats.first_detection_ms < 0)
+            stats.first_detection_ms = elapsed_ms(start);
+    }
+
+    Letterbox letterbox(const cv::Mat& image, const cv::Point& offset, const bool rect, const int frame = 0) const {
+        IMGUTIL_TRACE_SPAN("letterbox");
+        cv::Size net_size(params.input_width, params.input_height);
+        if (rect) {
+            const int long_side = std::max(params.input_width, params.input_height);
+            if (image.cols >= image.rows)
+                net_size = cv::Size(long_side, round_up32(long_side * image.rows / image.cols));
+            else
+                net_size = cv::Size(round_up32(long_side * image.cols / image.rows), long_side);
+        }
+
+        const double s = std::max(double(image.cols) / net_size.width, double(image.rows) / net_size.height);
+        const int padded_w = std::max(image.cols, int(std::ceil(net_size.width * s)));
+        const int padded_h = std::max(image.rows, int(std::ceil(net_size.height * s)));
+
+        Letterbox ret;
+        if (padded_w == image.cols && padded_h == image.rows) {
+            ret.input = image;
+        } else {
+            ret.input = cv::Mat::zeros(padded_h, padded_w, image.type());
+            image.copyTo(ret.input(cv::Rect(0, 0, image.cols, image.rows)));
+        }
+        ret.net_size = net_size;
+        ret.x_factor = float(padded_w) / net_size.width;
+        ret.y_factor = float(padded_h) / net_size.height;
+        ret.offset = offset;
+        ret.frame = frame;
+        return ret;
+    }
+
+    // overlapping square tiles covering the frame, the last row and column
+    // aligned to the frame edge
+    std::vector<cv::Rect> tile_grid(const cv::Size& size) const {
+        const int tile = params.tile_size;
+        const int step = std::max(1, int(tile * (1 - params.tile_overlap)));
+
+        auto starts = [&](const int extent) {
+            std::vector<int> ret;
+            for (int p = 0; ; p += step) {
+                if (p + tile >= extent) {
+                    ret.push_back(std::max(0, extent - tile));
+                    break;
+                }
+                ret.push_back(p);
+            }
+            return ret;
+        };
+
+        std::vector<cv::Rect> ret;
+        const cv::Rect bounds(cv::Point(), size);
+        for (const int y : starts(size.height))
+            for (const int x : starts(size.width))
+                ret.push_back(cv::Rect(x, y, tile, tile) & bounds);
+        return ret;
+    }
+
+    // candidates of batch entry b of out, in frame coordinates, appended
+    // to the candidates of the frame the entry came from
+    void decode(const cv::Mat& out, const int b, const Letterbox& lb, std::vector<std::vector<Detection>>& per_frame) const {
+        IMGUTIL_TRACE_SPAN("decode");
+        std::vector<Detection>& candidates = per_frame[lb.frame];
+        const int rows = out.dims == 3 ? out.size[1] : out.rows;
+        const int dims = out.dims == 3 ? out.size[2] : out.cols;
+        CV_Assert(dims == 5 + int(labels.size()));
+
+        const float* data = out.ptr<float>() + size_t(b) * rows * dims;
+        for (int i = 0; i < rows; ++i, data += dims) {
+            const float confidence = data[4];
+            if (confidence < params.confidence_threshold) continue;
+
+            const float* label_scores = data + 5;
+            const int label_id = std::max_element(label_scores, label_scores + labels.size()) - label_scores;
+            if (label_scores[label_id] <= params.score_threshold) continue;
+
+            const float x = data[0], y = data[1], w = data[2], h = data[3];
+            const int left = int((x - 0.5f * w) * lb.x_factor) + lb.offset.x;
+            const int top = int((y - 0.5f * h) * lb.y_factor) + lb.offset.y;
+            candidates.push_back({label_id, confidence, cv::Rect(left, top, int(w * lb.x_factor), int(h * lb.y_factor))});
+        }
+    }
+
+    cv::Mat forward(const std::vector<cv::Mat>& inputs, const cv::Size& net_size) {
+        cv::Mat blob;
+        {
+            IMGUTIL_TRACE_SPAN("blob");
+            cv::dnn::blobFromImages(inputs, blob, 1./255., net_size, cv::Scalar(), true, false);
+        }
+        IMGUTIL_TRACE_SPAN("forward");
+        net.setInput(blob);
+
+        std::vector<cv::Mat> outputs;
+        net.forward(outputs, output_names);
+        return outputs[0];
+    }
+
+    // run letterboxed inputs of the same net size, batched into one forward
+    // pass when the export allows it
+    void run(const std::vector<Letterbox>& batch, std::vector<std::vector<Detection>>& candidates) {
+        if (batch.empty()) return;
+
+        std::vector<cv::Mat> inputs;
+        for (const Letterbox& lb : batch) inputs.push_back(lb.input);
+
+        if (batch_ok && batch.size() > 1) {
+            try {
+                const cv::Mat out = forward(inputs, batch.front().net_size);
+                for (size_t b = 0; b < batch.size(); ++b)
+                    decode(out, b, batch[b], candidates);
+                return;
+            } catch (const cv::Exception&) {
+                // fixed batch-1 export, fall back to one pass per input
+                batch_ok = false;
+            }
+        }
+        for (const Letterbox& lb : batch)
+            decode(forward({lb.input}, lb.net_size), 0, lb, candidates);
+    }
+
+    std::vector<Detection> suppress(const std::vector<Detection>& candidates) const {
+        IMGUTIL_TRACE_SPAN("nms");
+        std::vector<cv::Rect> boxes;
+        std::vector<float> confidences;
+        std::vector<int> label_ids;
+        boxes.reserve(candidates.size());
+        confidences.reserve(candidates.size());
+        label_ids.reserve(candidates.size());
+        for (const Detection& d : candidates) {
+            boxes.push_back(d.box);
+            confidences.push_back(d.confidence);
+            label_ids.push_back(d.labelId);
+        }
+
+        NmsParams nms_params;
+        nms_params.iou_threshold = params.nms_threshold;
+        nms_params.score_threshold = params.score_threshold;
+        nms_params.top_k = params.nms_top_k;
+        nms_params.class_aware = params.class_aware_nms;
+        nms_params.soft = params.soft_nms;
+
+        std::vector<float> scores;
+        std::vector<Detection> ret;
+        for (const int idx : nms(boxes, confidences, label_ids, nms_params, &scores)) {
+            ret.push_back(candidates[idx]);
+            ret.back().confidence = scores[idx];
+        }
+        return ret;
+    }
+
+public:
+
+    Detector(const DetectorParams& _params = DetectorParams())
+        : params(_params), net(load_net(_params.model_path, _params.dnn)), labels(load_classes(_params.classes_path)) {
+        output_names = net.getUnconnectedOutLayersNames();
+        if (params.validate_model) validate();
+        stats.load_ms = elapsed_ms(created);
+        stats.ready_ms = stats.load_ms;
+    }
+
+    const DetectorMetrics& metrics() const { return stats; }
+
+    // The first forward pass allocates layer buffers and selects kernels and
+    // is far slower than the rest; run it, and a few more, on blank frames
+    // at the configured input size so real frames start at steady state.
+    void warm_up(const int runs = 2) {
+        IMGUTIL_TRACE_SPAN("Detector::warm_up");
+        const auto start = Clock::now();
+        const cv::Size input(params.input_width, params.input_height);
+        const cv::Mat blank = cv::Mat::zeros(input, CV_8UC3);
+        for (int i = 0; i < runs; ++i)
+            forward({blank}, input);
+        stats.warm_up_ms = elapsed_ms(start);
+        stats.ready_ms = stats.load_ms + stats.warm_up_ms;
+    }
+
+    // rows a YOLOv5 head produces for an input: 3 anchors per cell on the
+    // stride 8, 16 and 32 grids (25200 for 640x640)
+    static int expected_rows(const cv::Size& input) {
+        int rows = 0;
+        for (const int stride : {8, 16, 32})
+            rows += 3 * (input.width / stride) * (input.height / stride);
+        return rows;
+    }
+
+    // run a blank frame through the net and check that the output is what
+    // the decoder reads: expected_rows x (5 + number of classes)
+    void validate() {
+        const cv::Size input(params.input_width, params.input_height);
+        const cv::Mat out = forward({cv::Mat::zeros(input, CV_8UC3)}, input);
+        const int rows = out.dims == 3 ? out.size[1] : out.rows;
+        const int dims = out.dims == 3 ? out.size[2] : out.cols;
+
+        if (rows != expected_rows(input) || dims != 5 + int(labels.size())) {
+            std::cerr << params.model_path << ": output " << rows << "x" << dims
+                      << ", decoder expects " << expected_rows(input) << "x" << 5 + labels.size() << std::endl;
+            throw ModelShapeErr{};
+        }
+    }
+
+    const DetectorParams& get_params() const { return params; }
+    const std::vector<std::string>& classes() const { return labels; }
+
+    static std::vector<std::string> load_classes(const std::string& path) {
+        std::vector<std::string> classes;
+        std::ifstream ifs(path);
+        std::string line;
+        while (getline(ifs, line)){
+            classes.push_back(line);
+        }
+        return classes;
+    }
+
+    static cv::dnn::Net load_net(const std::string& path, const DnnConfig& dnn = DnnConfig()) {
+        cv::dnn::Net nn = cv::dnn::readNet(path);
+        dnn.apply(nn);
+        return nn;
+    }
+
+    // detections in frame coordinates
+    std::vector<Detection> detect(const cv::Mat& frame) {
+        IMGUTIL_TRACE_SPAN("Detector::detect");
+        const auto start = Clock::now();
+        std::vector<std::vector<Detection>> candidates(1);
+
+        if (params.tile_size > 0 && std::max(frame.cols, frame.rows) > params.tile_size) {
+            std::vector<Letterbox> tiles;
+            for (const cv::Rect& tile : tile_grid(frame.size()))
+                tiles.push_back(letterbox(frame(tile), tile.tl(), false));
+            run(tiles, candidates);
+
+            if (params.tile_full_frame)
+                run({letterbox(frame, cv::Point(), params.rect_input)}, candidates);
+        } else {
+            run({letterbox(frame, cv::Point(), params.rect_input)}, candidates);
+        }
+
+        // one suppression across tiles removes the duplicates in overlaps
+        std::vector<Detection> ret = suppress(candidates[0]);
+        note_detection(start);
+        return ret;
+    }
+
+    // detections for several frames, letterboxed to the square input and run
+    // through one batched forward pass; tiled detectors go frame by frame
+    std::vector<std::vector<Detection>> detect_batch(const std::vector<cv::Mat>& frames) {
+        IMGUTIL_TRACE_SPAN("Detector::detect_batch");
+        const auto start = Clock::now();
+        std::vector<std::vector<Detection>> ret;
+        if (params.tile_size > 0) {
+            for (const cv::Mat& frame : frames) ret.push_back(detect(frame));
+            return ret;
+        }
+
+        std::vector<Letterbox> batch;
+        for (size_t i = 0; i < frames.size(); ++i)
+            batch.push_back(letterbox(frames[i], cv::Point(), false, i));
+
+        std::vector<std::vector<Detection>> candidates(frames.size());
+        run(batch, candidates);
+        for (const auto& c : candidates) ret.push_back(suppress(c));
+        note_detection(start);
+        return ret;
+    }
+
+    void draw(const std::vector<Detection>& output, cv::Mat& frame) const {
+        IMGUTIL_TRACE_SPAN("draw");
+        draw_detections(output, frame, labels);
+    }
+};
+
+// the process-wide detector set up by preload_detector
+struct SharedDetector {
+    std::shared_ptr<Detector> detector;
+    std::mutex mutex;
+};
+
+inline SharedDetector& shared_detector() {
+    static SharedDetector shared;
+    return shared;
+}
+
+// Load the model and warm it up now, typically at process start, so that
+// detection calls with the same parameters skip both costs.
+inline std::shared_ptr<Detector> preload_detector(const DetectorParams& params = DetectorParams(), const int warm_up_runs = 2) {
+    auto detector = std::make_shared<Detector>(params);
+    detector->warm_up(warm_up_runs);
+
+    SharedDetector& shared = shared_detector();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    shared.detector = detector;
+    return detector;
+}
+
+// Exclusive use of a detector for params: the preloaded one when it was
+// loaded with the same parameters (held locked for the lease's lifetime),
+// otherwise a freshly loaded one.
+class DetectorLease {
+
+    friend class DetectorHandle;
+
+    std::unique_lock<std::mutex> lock;
+    std::shared_ptr<Detector> detector;
+
+    // lease a detector already resolved, locking it when it is the shared one
+    DetectorLease(std::shared_ptr<Detector> _detector, const bool shared) : detector(std::move(_detector)) {
+        if (shared) lock = std::unique_lock<std::mutex>(shared_detector().mutex);
+    }
+
+public:
+
+    DetectorLease(const DetectorParams& params) {
+        SharedDetector& shared = shared_detector();
+        std::unique_lock<std::mutex> shared_lock(shared.mutex);
+        if (shared.detector && shared.detector->get_params() == params) {
+            lock = std::move(shared_lock);
+            detector = shared.detector;
+        } else {
+            shared_lock.unlock();
+            detector = std::make_shared<Detector>(params);
+        }
+    }
+
+    Detector& operator*() const { return *detector; }
+    Detector* operator->() const { return detector.get(); }
+};
+
+// A detector for params resolved once, as by DetectorLease, for loops that
+// detect over and over: each iteration takes its own short lease, so a long
+// run such as video detection holds the preloaded detector only while a
+// frame is being detected, not between frames.
+class DetectorHandle {
+
+    std::shared_ptr<Detector> detector;
+    bool shared = false;
+
+public:
+
+    DetectorHandle(const DetectorParams& params) {
+        SharedDetector& shared_state = shared_detector();
+        std::unique_lock<std::mutex> lock(shared_state.mutex);
+        if (shared_state.detector && shared_state.detector->get_params() == params) {
+            detector = shared_state.detector;
+            shared = true;
+        } else {
+            lock.unlock();
+            detector = std::make_shared<Detector>(params);
+        }
+    }
+
+    DetectorLease lease() const { return DetectorLease(detector, shared); }
+};
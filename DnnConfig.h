@@ -0,0 +1,166 @@
+//
+// DNN backend, target and thread configuration, with a startup self-benchmark
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+
+// OpenCV gained a dedicated fp16 CPU target in 4.8
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+#define IMGUTIL_HAS_CPU_FP16 1
+#else
+#define IMGUTIL_HAS_CPU_FP16 0
+#endif
+
+struct DnnConfig {
+    int backend = cv::dnn::DNN_BACKEND_OPENCV;
+    int target = cv::dnn::DNN_TARGET_CPU;
+    int threads = -1;   // process-wide thread count, set by apply_threads; -1 keeps OpenCV's default
+
+    bool operator==(const DnnConfig&) const = default;
+
+    std::string name() const {
+        std::string ret = backend == cv::dnn::DNN_BACKEND_INFERENCE_ENGINE ? "openvino" : "opencv";
+        ret += target == cv::dnn::DNN_TARGET_CPU ? "/cpu" : "/cpu_fp16";
+        if (threads >= 0) ret += "/" + std::to_string(threads) + "t";
+        return ret;
+    }
+
+    // apply backend and target to a net. The thread count is left out: it
+    // is process-wide in OpenCV (and caps the shared executor when that
+    // drives OpenCV), so loading one model must not re-cap every other
+    // pipeline; see apply_threads
+    void apply(cv::dnn::Net& net) const {
+        net.setPreferableBackend(backend);
+        net.setPreferableTarget(target);
+    }
+
+    // set the process-wide thread count, once at startup, after
+    // configure_executor; nothing when threads is -1
+    void apply_threads() const {
+        if (threads >= 0) cv::setNumThreads(threads);
+    }
+
+    // IMGUTIL_DNN_BACKEND=opencv|openvino, IMGUTIL_DNN_TARGET=cpu|cpu_fp16,
+    // IMGUTIL_DNN_THREADS=n, applied by apply_threads; unset variables keep
+    // the defaults
+    static DnnConfig from_env() {
+        DnnConfig ret;
+        if (const char* b = std::getenv("IMGUTIL_DNN_BACKEND")) {
+            if (std::string(b) == "openvino") ret.backend = cv::dnn::DNN_BACKEND_INFERENCE_ENGINE;
+        }
+#if IMGUTIL_HAS_CPU_FP16
+        if (const char* t = std::getenv("IMGUTIL_DNN_TARGET")) {
+            if (std::string(t) == "cpu_fp16") ret.target = cv::dnn::DNN_TARGET_CPU_FP16;
+        }
+#endif
+        if (const char* n = std::getenv("IMGUTIL_DNN_THREADS"))
+            ret.threads = std::atoi(n);
+        return ret;
+    }
+
+    // every CPU backend/target pair this OpenCV build can run
+    static std::vector<DnnConfig> available_cpu() {
+        std::vector<DnnConfig> ret;
+        for (const int backend : {int(cv::dnn::DNN_BACKEND_OPENCV), int(cv::dnn::DNN_BACKEND_INFERENCE_ENGINE)}) {
+            for (const cv::dnn::Target target : cv::dnn::getAvailableTargets(cv::dnn::Backend(backend))) {
+                bool cpu = target == cv::dnn::DNN_TARGET_CPU;
+#if IMGUTIL_HAS_CPU_FP16
+                cpu = cpu || target == cv::dnn::DNN_TARGET_CPU_FP16;
+#endif
+                if (!cpu) continue;
+                DnnConfig cfg;
+                cfg.backend = backend;
+                cfg.target = target;
+                ret.push_back(cfg);
+            }
+        }
+        return ret;
+    }
+};
+
+struct DnnBenchmarkResult {
+    DnnConfig config;
+    double median_ms = -1;  // -1 when the configuration failed to run the model
+};
+
+// Time a few forward passes of the model under every available CPU
+// configuration and thread count, fastest first. Meant to run once at
+// startup to pick the configuration for the host.
+static std::vector<DnnBenchmarkResult> benchmark_dnn_configs(
+    const std::string& model_path,
+    const cv::Size& input_size = cv::Size(640, 640),
+    const int runs = 5,
+    std::vector<int> thread_counts = {}) {
+    if (thread_counts.empty()) {
+        const int cores = cv::getNumberOfCPUs();
+        thread_counts = {cores};
+        if (cores > 2) thread_counts.push_back(cores / 2);
+    }
+    const int saved_threads = cv::getNumThreads();
+
+    cv::Mat blob;
+    cv::Mat noise(input_size, CV_8UC3);
+    cv::randu(noise, 0, 255);
+    cv::dnn::blobFromImage(noise, blob, 1./255., input_size, cv::Scalar(), true, false);
+
+    std::vector<DnnBenchmarkResult> results;
+    for (DnnConfig cfg : DnnConfig::available_cpu()) {
+        for (const int threads : thread_counts) {
+            cfg.threads = threads;
+            DnnBenchmarkResult result{cfg};
+            try {
+                // process-wide, restored below once every configuration ran
+                cv::setNumThreads(threads);
+                cv::dnn::Net net = cv::dnn::readNet(model_path);
+                cfg.apply(net);
+                const auto names = net.getUnconnectedOutLayersNames();
+                std::vector<cv::Mat> outputs;
+
+                // first pass allocates layers and picks kernels, not timed
+                net.setInput(blob);
+                net.forward(outputs, names);
+
+                std::vector<double> times;
+                for (int i = 0; i < runs; ++i) {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    net.setInput(blob);
+                    net.forward(outputs, names);
+                    auto end = std::chrono::high_resolution_clock::now();
+                    times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+                }
+                std::sort(times.begin(), times.end());
+                result.median_ms = times[times.size() / 2];
+            } catch (const cv::Exception& e) {
+                std::cerr << cfg.name() << " unavailable: " << e.what() << std::endl;
+            }
+            results.push_back(result);
+        }
+    }
+    cv::setNumThreads(saved_threads);
+
+    std::stable_sort(results.begin(), results.end(), [](const DnnBenchmarkResult& a, const DnnBenchmarkResult& b) {
+        if ((a.median_ms < 0) != (b.median_ms < 0)) return b.median_ms < 0;
+        return a.median_ms < b.median_ms;
+    });
+    return results;
+}
+
+// the fastest configuration on this host, defaults if none ran
+static DnnConfig pick_fastest_dnn_config(const std::string& model_path, const cv::Size& input_size = cv::Size(640, 640)) {
+    const auto results = benchmark_dnn_configs(model_path, input_size);
+    for (const DnnBenchmarkResult& r : results)
+        std::cout << "  " << r.config.name() << ": " << r.median_ms << " ms\n";
+    if (results.empty() || results.front().median_ms < 0) return DnnConfig();
+    return results.front().config;
+}
@@ -0,0 +1,452 @@
+//
+// Process-wide work-stealing executor shared by every parallel path
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// OpenCV 4.5.2 lets an application supply the pool behind cv::parallel_for_
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#define IMGUTIL_HAS_PARALLEL_BACKEND 1
+#else
+#define IMGUTIL_HAS_PARALLEL_BACKEND 0
+#endif
+
+
+// Queued work runs latency lane first; batch work only gets the workers no
+// latency-critical task is waiting for.
+enum class Lane {
+    LATENCY = 0,    // live video, interactive requests
+    BATCH = 1       // offline processing, the default
+};
+
+struct ExecutorParams {
+    int threads = 0;            // worker threads, 0 = one per cpu in use less the caller's
+    bool pin = false;           // pin worker i to cpus[i % cpus.size()] (Linux)
+    std::vector<int> cpus;      // cpus to pin to, the process's allowed cpus when empty; list one NUMA node's to keep a job on it
+    bool drive_opencv = true;   // run cv::parallel_for_, and so OpenCV's own kernels and DNN, on this pool
+
+    // IMGUTIL_THREADS=n, IMGUTIL_PIN=1, IMGUTIL_CPUS=0-3,8,9; unset
+    // variables keep the defaults
+    static ExecutorParams from_env() {
+        ExecutorParams ret;
+        if (const char* n = std::getenv("IMGUTIL_THREADS")) ret.threads = std::atoi(n);
+        if (const char* p = std::getenv("IMGUTIL_PIN")) ret.pin = std::string(p) == "1";
+        if (const char* c = std::getenv("IMGUTIL_CPUS")) ret.cpus = parse_cpu_list(c);
+        return ret;
+    }
+
+    // a cpu list in the kernel's format, comma separated cpus and ranges
+    static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> ret;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos) end = list.size();
+            const std::string item = list.substr(pos, end - pos);
+            const size_t dash = item.find('-');
+            try {
+                const int first = std::stoi(item.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int c = first; c <= last; ++c) ret.push_back(c);
+            } catch (const std::exception&) {
+                std::cerr << "IMGUTIL_CPUS: ignoring " << item << std::endl;
+            }
+            pos = end + 1;
+        }
+        return ret;
+    }
+};
+
+// the cpus this process may run on, which a cpuset or taskset narrows;
+// every cpu when that cannot be queried
+inline std::vector<int> allowed_cpus() {
+    std::vector<int> ret;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &set)) ret.push_back(c);
+        return ret;
+    }
+#endif
+    for (int c = 0; c < int(std::thread::hardware_concurrency()); ++c) ret.push_back(c);
+    return ret;
+}
+
+// A fixed pool of workers, each with its own deque. Tasks submitted from
+// outside go to a queue per lane; tasks submitted by a running task go to
+// that worker's deque, which idle workers steal from. parallel_for has the
+// calling thread work through the range as well, so nested calls from
+// inside tasks cannot deadlock the pool.
+class Executor {
+
+    friend class LaneScope;
+
+    using Task = std::function<void()>;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;     // owner pops the back, thieves take the front
+        std::thread thread;
+    };
+
+    // one parallel_for call: chunks are claimed from a shared counter by
+    // whichever threads get to it, the caller included
+    struct Job {
+        std::function<void(const cv::Range&)> body;
+        cv::Range range;
+        int chunk;
+        int chunks;
+        Lane lane;
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+
+        void run_chunks() {
+            int c;
+            while ((c = next.fetch_add(1)) < chunks) {
+                const cv::Range r(range.start + c * chunk, std::min(range.end, range.start + (c + 1) * chunk));
+                try {
+                    body(r);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                }
+                if (done.fetch_add(1) + 1 == chunks) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+
+    ExecutorParams params;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Task> lanes[2];
+    std::atomic<int> queued{0};
+    std::atomic<int> concurrency_cap{0};    // cv::setNumThreads through the OpenCV backend
+    bool stopping = false;
+
+    static int& local_index() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    static Lane& local_lane() {
+        thread_local Lane lane = Lane::BATCH;
+        return lane;
+    }
+
+    bool pop_lane(const Lane lane, Task& task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::deque<Task>& q = lanes[int(lane)];
+        if (q.empty()) return false;
+        task = std::move(q.front());
+        q.pop_front();
+        return true;
+    }
+
+    bool pop_local(const int self, Task& task) {
+        Worker& w = *workers[self];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.tasks.empty()) return false;
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(const int self, Task& task) {
+        const int n = workers.size();
+        for (int k = 1; k <= n; ++k) {
+            Worker& w = *workers[(self + k) % n];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (w.tasks.empty()) continue;
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    // latency lane, then own deque, then others' deques, then batch lane
+    bool run_one(const int self) {
+        Task task;
+        if (!pop_lane(Lane::LATENCY, task)
+            && !pop_local(self, task)
+            && !steal(self, task)
+            && !pop_lane(Lane::BATCH, task))
+            return false;
+        queued.fetch_sub(1);
+        task();
+        return true;
+    }
+
+    void push(Task task, const Lane lane) {
+        const int self = local_index();
+        if (self >= 0 && lane != Lane::LATENCY) {
+            Worker& w = *workers[self];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.tasks.push_back(std::move(task));
+        } else {
+            std::lock_guard<std::mutex> lock(mutex);
+            lanes[int(lane)].push_back(std::move(task));
+        }
+        queued.fetch_add(1);
+        // a worker between checking queued and waiting holds the mutex, so
+        // taking it here means the notify cannot fall in that gap
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        wake.notify_one();
+    }
+
+    void work(const int index) {
+        local_index() = index;
+        while (true) {
+            if (run_one(index)) continue;
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) return;
+        }
+    }
+
+    // pin a worker to one of cpus, reporting a cpu the process may not use
+    static void pin(std::thread& thread, const int index, const std::vector<int>& cpus) {
+#ifdef __linux__
+        if (cpus.empty()) return;
+        const int cpu = cpus[index % cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (const int err = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set))
+            std::cerr << "Executor: could not pin worker " << index << " to cpu " << cpu << " (error " << err << ")" << std::endl;
+#else
+        (void)thread;
+        (void)index;
+        (void)cpus;
+#endif
+    }
+
+public:
+
+    Executor(const ExecutorParams& _params = ExecutorParams()) : params(_params) {
+        // workers go on the listed cpus, or the ones this process is
+        // allowed, so co-located processes confined to different cpusets
+        // do not all pin onto cpu 0 upwards
+        const std::vector<int> cpus = params.cpus.empty() ? allowed_cpus() : params.cpus;
+        int n = params.threads;
+        if (n <= 0) n = std::max(1, int(cpus.size()) - 1);
+        for (int i = 0; i < n; ++i) workers.push_back(std::make_unique<Worker>());
+        for (int i = 0; i < n; ++i) {
+            workers[i]->thread = std::thread(&Executor::work, this, i);
+            if (params.pin) pin(workers[i]->thread, i, cpus);
+        }
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // finishes every queued task, then joins the workers
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) w->thread.join();
+    }
+
+    int size() const { return workers.size(); }
+
+    // threads that work on a parallel_for: the workers and the caller,
+    // capped by cv::setNumThreads when this pool drives OpenCV
+    int concurrency() const {
+        const int cap = concurrency_cap.load();
+        return cap > 0 ? std::min(cap, size() + 1) : size() + 1;
+    }
+
+    void set_concurrency_cap(const int cap) { concurrency_cap.store(cap); }
+
+    // index of the calling worker, -1 on any other thread
+    static int worker_index() { return local_index(); }
+
+    // lane work submitted from this thread goes to by default; tasks run
+    // with the lane they were submitted on, so nested work inherits it
+    static Lane current_lane() { return local_lane(); }
+
+    // run f on the pool, the future carries its result or exception
+    template <typename F>
+    auto submit(F&& f, const Lane lane = current_lane()) -> std::future<decltype(f())> {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> ret = task->get_future();
+        push([task, lane] {
+            const Lane saved = local_lane();
+            local_lane() = lane;
+            (*task)();
+            local_lane() = saved;
+        }, lane);
+        return ret;
+    }
+
+    // Run body over range in chunks of at least grain, on up to
+    // concurrency() threads including the caller, which returns once every
+    // chunk is done; the first exception a chunk throws is rethrown here.
+    void parallel_for(const cv::Range& range, std::function<void(const cv::Range&)> body, const Lane lane = current_lane(), const int grain = 1) {
+        const int total = range.end - range.start;
+        if (total <= 0) return;
+        const int threads = concurrency();
+        if (threads <= 1 || total <= grain) {
+            body(range);
+            return;
+        }
+
+        auto job = std::make_shared<Job>();
+        job->body = std::move(body);
+        job->range = range;
+        // a few chunks per thread so uneven chunks balance out
+        job->chunk = std::max(grain, (total + 4 * threads - 1) / (4 * threads));
+        job->chunks = (total + job->chunk - 1) / job->chunk;
+        job->lane = lane;
+
+        const int helpers = std::min(threads - 1, job->chunks - 1);
+        for (int i = 0; i < helpers; ++i) {
+            push([job] {
+                const Lane saved = local_lane();
+                local_lane() = job->lane;
+                job->run_chunks();
+                local_lane() = saved;
+            }, lane);
+        }
+
+        const Lane saved = local_lane();
+        local_lane() = lane;
+        job->run_chunks();
+        local_lane() = saved;
+
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&] { return job->done.load() == job->chunks; });
+        if (job->error) std::rethrow_exception(job->error);
+    }
+};
+
+// tags work started on this thread with a lane for the scope's lifetime,
+// e.g. a live video loop so the OpenCV kernels it calls jump the batch queue
+class LaneScope {
+
+    Lane saved;
+
+public:
+
+    explicit LaneScope(const Lane lane) : saved(Executor::current_lane()) { Executor::local_lane() = lane; }
+    ~LaneScope() { Executor::local_lane() = saved; }
+
+    LaneScope(const LaneScope&) = delete;
+    LaneScope& operator=(const LaneScope&) = delete;
+};
+
+#if IMGUTIL_HAS_PARALLEL_BACKEND
+// cv::parallel_for_ backend running on an Executor; cv::setNumThreads
+// becomes a cap on how many of its threads one parallel_for_ uses
+class ExecutorParallelBackend : public cv::parallel::ParallelForAPI {
+
+    Executor& executor;
+
+public:
+
+    explicit ExecutorParallelBackend(Executor& _executor) : executor(_executor) {}
+
+    void parallel_for(int tasks, FN_parallel_for_body_cb_t body, void* data) override {
+        executor.parallel_for(cv::Range(0, tasks), [body, data](const cv::Range& r) { body(r.start, r.end, data); });
+    }
+
+    // OpenCV expects 0 for the calling thread and 1..n for pool threads, and
+    // sizes per-thread buffers by getNumThreads, so that covers every
+    // worker; the cap only limits how many of them one parallel_for uses
+    int getThreadNum() const override { return Executor::worker_index() + 1; }
+    int getNumThreads() const override { return executor.size() + 1; }
+
+    // 0 means run serially, as it does for OpenCV's own pools
+    int setNumThreads(int n) override {
+        const int prev = executor.concurrency();
+        executor.set_concurrency_cap(std::max(1, n));
+        return prev;
+    }
+
+    const char* getName() const override { return "imgutil-executor"; }
+};
+#endif
+
+inline std::atomic<Executor*>& executor_slot() {
+    static std::atomic<Executor*> slot{nullptr};
+    return slot;
+}
+
+inline std::mutex& executor_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Set up the process-wide executor. Call it once at startup, before any
+// library work and before other threads start, since with drive_opencv it
+// replaces the pool behind every cv::parallel_for_ in the process. Once an
+// executor exists, from an earlier call or from the library's first use,
+// later calls change nothing and return it. It is never destroyed, OpenCV
+// may call into it until exit.
+inline Executor& configure_executor(const ExecutorParams& params = ExecutorParams::from_env()) {
+    std::lock_guard<std::mutex> lock(executor_mutex());
+    if (Executor* existing = executor_slot().load()) {
+        std::cerr << "Executor already running with " << existing->size() << " workers, parameters ignored" << std::endl;
+        return *existing;
+    }
+
+    Executor* executor = new Executor(params);
+#if IMGUTIL_HAS_PARALLEL_BACKEND
+    if (params.drive_opencv)
+        cv::parallel::setParallelForBackend(std::make_shared<ExecutorParallelBackend>(*executor), false);
+#endif
+    executor_slot().store(executor);
+    return *executor;
+}
+
+// The process-wide executor the library's own loops run on. Without a
+// configure_executor call it is created on first use from the environment
+// and leaves OpenCV's pool alone.
+inline Executor& shared_executor() {
+    if (Executor* executor = executor_slot().load()) return *executor;
+    std::lock_guard<std::mutex> lock(executor_mutex());
+    if (Executor* executor = executor_slot().load()) return *executor;
+    ExecutorParams params = ExecutorParams::from_env();
+    params.drive_opencv = false;
+    Executor* executor = new Executor(params);
+    executor_slot().store(executor);
+    return *executor;
+}
@@ -0,0 +1,60 @@
+//
+// Stateless per-frame filters shared by the Video processing paths
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "Threshold.h"
+#include "Warp.h"
+
+
+// A per-frame operation: reads in, writes out. Copies of a filter must be
+// usable concurrently, each on its own thread, so any working buffers live
+// in the callable itself and are duplicated with it.
+using FrameFilter = std::function<void(const cv::Mat& in, cv::Mat& out)>;
+
+static FrameFilter grayscale_filter() {
+    return [](const cv::Mat& in, cv::Mat& out) {
+        cv::cvtColor(in, out, cv::COLOR_BGR2GRAY);
+    };
+}
+
+static FrameFilter edge_detect_filter(const int lower_threshold, const int upper_threshold) {
+    return [=](const cv::Mat& in, cv::Mat& out) {
+        cv::Canny(in, out, lower_threshold, upper_threshold);
+    };
+}
+
+static FrameFilter gaussian_blur_filter(const int kernel_sz) {
+    return [=](const cv::Mat& in, cv::Mat& out) {
+        cv::GaussianBlur(in, out, cv::Size(kernel_sz, kernel_sz), 0);
+    };
+}
+
+static FrameFilter threshold_filter(const ThresholdParams& params) {
+    // each copy of the filter owns its engine and thus its buffers
+    return [engine = ThresholdEngine(params)](const cv::Mat& in, cv::Mat& out) mutable {
+        engine.apply(in, out);
+    };
+}
+
+// warp every frame with the homography taking points onto the corners of a
+// frame_size frame; the remap tables are built once and shared read-only
+static FrameFilter homography_filter(const std::vector<cv::Point>& points, const cv::Size& frame_size) {
+    const std::vector<cv::Point> dst_points = {
+        cv::Point(0,                0),
+        cv::Point(frame_size.width, 0),
+        cv::Point(frame_size.width, frame_size.height),
+        cv::Point(0,                frame_size.height),
+    };
+    auto warp = std::make_shared<const Warp>(Warp::from_points(points, dst_points, frame_size));
+    return [warp](const cv::Mat& in, cv::Mat& out) {
+        warp->apply(in, out);
+    };
+}
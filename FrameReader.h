@@ -0,0 +1,184 @@
+//
+// Background capture reader filling a ring of frames ahead of the consumer
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Trace.h"
+
+
+// what the reader does when the consumer falls behind and the ring is full
+enum class ReaderPolicy {
+    BLOCK,          // wait for the consumer, every frame is delivered (files)
+    DROP_OLDEST,    // overwrite the oldest unread frame (cameras, streams)
+};
+
+// Reads and decodes frames on its own thread into a ring of pre-allocated
+// frames, so decode latency overlaps with processing. Frames are handed to
+// the consumer by swapping buffers, never copied.
+class FrameReader {
+
+public:
+
+    using Clock = std::chrono::steady_clock;
+
+private:
+
+    cv::VideoCapture capture;
+    const ReaderPolicy policy;
+    const double pace_fps;
+
+    std::vector<cv::Mat> ring;
+    std::vector<Clock::time_point> stamps;  // when each frame left the decoder
+    size_t head = 0;
+    size_t count = 0;
+    size_t dropped = 0;
+    bool finished = false;
+    bool stopping = false;
+
+    mutable std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::thread worker;
+
+    void run() {
+        const auto period = pace_fps > 0
+            ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / pace_fps))
+            : Clock::duration::zero();
+        auto next_due = Clock::now();
+
+        while (true) {
+            size_t slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (policy == ReaderPolicy::BLOCK)
+                    not_full.wait(lock, [&] { return stopping || count < ring.size(); });
+                if (stopping) break;
+
+                if (count == ring.size()) {
+                    head = (head + 1) % ring.size();
+                    --count;
+                    ++dropped;
+                }
+                // the slot past the last unread frame is invisible to the
+                // consumer until count grows, so it is filled without the lock
+                slot = (head + count) % ring.size();
+            }
+
+            // replay files at their frame rate to stand in for a live source
+            if (period != Clock::duration::zero()) {
+                std::this_thread::sleep_until(next_due);
+                next_due += period;
+            }
+
+            bool ok;
+            {
+                IMGUTIL_TRACE_SPAN("FrameReader::decode");
+                ok = capture.read(ring[slot]);
+            }
+            const auto stamp = Clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ok || stopping) break;
+                stamps[slot] = stamp;
+                ++count;
+            }
+            not_empty.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        not_empty.notify_all();
+    }
+
+public:
+
+    // depth frames are decoded ahead; pace_fps > 0 throttles reading to that
+    // rate, e.g. to replay a file as if it were a camera
+    FrameReader(
+        const cv::VideoCapture& _capture,
+        const size_t depth = 4,
+        const ReaderPolicy _policy = ReaderPolicy::BLOCK,
+        const double _pace_fps = 0)
+        : capture(_capture), policy(_policy), pace_fps(_pace_fps), ring(std::max<size_t>(depth, 1)), stamps(ring.size()) {
+        const int width = capture.get(cv::CAP_PROP_FRAME_WIDTH);
+        const int height = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+        if (width > 0 && height > 0)
+            for (cv::Mat& frame : ring)
+                frame.create(height, width, CV_8UC3);
+
+        worker = std::thread(&FrameReader::run, this);
+    }
+
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+
+    ~FrameReader() { stop(); }
+
+    // take the oldest unread frame, blocks until one is decoded;
+    // false once the source is exhausted and every frame was taken
+    bool read(cv::Mat& frame, Clock::time_point* stamp = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return count > 0 || finished; });
+        if (count == 0) return false;
+
+        // the caller's previous buffer goes back into the ring, unless it is
+        // still shared elsewhere and would be overwritten under someone's feet
+        if (frame.u && frame.u->refcount > 1)
+            frame.release();
+        std::swap(frame, ring[head]);
+        if (stamp) *stamp = stamps[head];
+
+        head = (head + 1) % ring.size();
+        --count;
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    // take the newest decoded frame, discarding any older unread ones
+    bool read_latest(cv::Mat& frame, Clock::time_point* stamp = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return count > 0 || finished; });
+        if (count == 0) return false;
+
+        const size_t newest = (head + count - 1) % ring.size();
+        dropped += count - 1;
+
+        if (frame.u && frame.u->refcount > 1)
+            frame.release();
+        std::swap(frame, ring[newest]);
+        if (stamp) *stamp = stamps[newest];
+
+        head = (newest + 1) % ring.size();
+        count = 0;
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    // frames overwritten or skipped before the consumer got to them
+    size_t dropped_frames() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped;
+    }
+
+    // stop reading, waits for a decode in progress to finish
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        not_full.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+};
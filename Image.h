@@ -6,11 +6,24 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "Threshold.h"
+#include "Region.h"
+#include "Warp.h"
+#include "Blend.h"
+#include "Resize.h"
+#include "Pyramid.h"
+#include "ImageView.h"
+#include "Trace.h"
+#include "Detector.h"
+#include "ModelManifest.h"
+#include "InferenceServer.h"
+
 #include <string>
 #include <vector>
 #include <iostream>
 #include <cassert>
 #include <fstream>
+#include <memory>
 
 
 struct NotEnoughPointsErr {};
@@ -24,21 +37,84 @@ static void debug_assert(bool var, const std::string& msg = "") {
     assert(var);
 }
 
+// Images are copy-on-write: copies, and Images made from a cv::Mat, share
+// one pixel buffer, and an operation that writes to the pixels first gives
+// its Image a private buffer if anything else still references the old one.
+// Sharing an Image between threads or pipeline branches is thus free until
+// one of them writes.
 class Image {
 
     // underlying data
     cv::Mat img;
+    // downscaled levels of img, created on the first request for a level
+    // and shared by copies made after that; null until then, so images that
+    // never use a level pay nothing for it
+    mutable std::shared_ptr<ImagePyramid> pyramid;
+
+    // make img safe to write: drop the pyramid, which is about to go stale,
+    // then clone the pixels if any other header or a foreign buffer holds them
+    void detach() {
+        pyramid.reset();
+        if (!img.empty() && (!img.u || img.u->refcount > 1))
+            img = img.clone();
+    }
+
+    // level n of img, creating the pyramid if this is the first level asked
+    // for; const callers on several threads may race to create it
+    cv::Mat level_mat(const int n, const PyramidMode mode = PyramidMode::GAUSSIAN) const {
+        if (n <= 0 || img.empty()) return img;
+        std::shared_ptr<ImagePyramid> p = std::atomic_load(&pyramid);
+        if (!p) {
+            auto fresh = std::make_shared<ImagePyramid>();
+            // on losing the race p is the winner's pyramid
+            if (std::atomic_compare_exchange_strong(&pyramid, &p, fresh)) p = fresh;
+        }
+        return p->level(img, n, mode);
+    }
 
 public:
 
     Image() = default;
     // construct an image from a filename
-    Image(const std::string& filename) : img(cv::imread(filename)) {
+    Image(const std::string& filename) {
+        IMGUTIL_TRACE_SPAN("imread");
+        img = cv::imread(filename);
         if (img.empty()) throw FailedToLoadImgErr{};
     }
-    // construct an image from a cv::Mat (cv's image class)
+    // construct an image from a cv::Mat (cv's image class), sharing its
+    // pixels until either side writes through this Image
     Image(const cv::Mat _img) : img(_img) {}
 
+    // copies share the pixels and any pyramid already built, which a
+    // const call on another thread may be creating
+    Image(const Image& other) : img(other.img), pyramid(std::atomic_load(&other.pyramid)) {}
+    Image& operator=(const Image& other) {
+        img = other.img;
+        pyramid = std::atomic_load(&other.pyramid);
+        return *this;
+    }
+    Image(Image&&) = default;
+    Image& operator=(Image&&) = default;
+
+    // read-only view of the pixels, shared with every copy of this image
+    const cv::Mat& mat() const { return img; }
+
+    // writable pixels; detaches first, so writes are seen by no other Image,
+    // and drops the pyramid, so levels asked for later are built from the
+    // new contents (write through the reference before asking for one)
+    cv::Mat& mutable_mat() {
+        detach();
+        return img;
+    }
+
+    // drop the cached pyramid levels. The pyramid only notices writes made
+    // through mutable_mat(); call this after writing to the pixels through a
+    // cv::Mat this Image was made from, or levels keep the old contents
+    void reset_pyramid() { std::atomic_store(&pyramid, std::shared_ptr<ImagePyramid>()); }
+
+    // whether another Image or cv::Mat currently shares the pixels
+    bool shared() const { return img.u && img.u->refcount > 1; }
+
     // display this image, optionally wait for a keystroke to move on
     void show(const std::string& filename = "Image") const {
         cv::namedWindow(filename, 1);
@@ -50,37 +126,117 @@ public:
 
     // save an image to the current directory
     void save(const std::string filename) {
+        IMGUTIL_TRACE_SPAN("imwrite");
         cv::imwrite(filename, img);
     }
 
     // clears all currently displayed windows
     static void destroy_all_windows() { cv::destroyAllWindows(); }
 
-    // resize this image such that it matches the size of other
-    void fit_to_size(const Image& other) { cv::resize(img, img, other.img.size()); }
+    // resize this image such that it matches the size of other; with
+    // params.cache, repeated fits of the same unchanged image to the same
+    // size come from shared_resize_cache()
+    void fit_to_size(const Image& other, const ResizeParams& params = ResizeParams()) {
+        IMGUTIL_TRACE_SPAN("Image::fit_to_size");
+        resize_image(img, img, other.img.size(), params);
+        pyramid.reset();
+    }
+
+    // returns this image resized to size
+    Image resize(const cv::Size& size, const ResizeParams& params = ResizeParams()) const {
+        IMGUTIL_TRACE_SPAN("Image::resize");
+        Image ret;
+        resize_image(img, ret.img, size, params);
+        return ret;
+    }
 
-    // returns the result of blending this image with another image at given weight
+    // returns the result of blending this image with another image at given
+    // weight; a smaller other covers only the top-left of this image
     Image alpha_blend(const Image& other, const double other_weight) const {
+        IMGUTIL_TRACE_SPAN("Image::alpha_blend");
+        // small images of the same size skip the in-place path and its copy
         Image ret;
-        cv::addWeighted(img, (1 - other_weight), other.img, other_weight, 0.0, ret.img);
+        if (typed_blend(img, other.img, other_weight, ret.img)) return ret;
+
+        // the fixed-point engine is 8-bit only, other depths go through OpenCV
+        if (img.depth() != CV_8U || other.img.depth() != CV_8U) {
+            if (other.img.size() == img.size()) {
+                cv::addWeighted(img, 1 - other_weight, other.img, other_weight, 0.0, ret.img);
+                return ret;
+            }
+            ret = *this;
+            const cv::Rect roi = cv::Rect(cv::Point(), other.img.size()) & cv::Rect(cv::Point(), img.size());
+            cv::Mat covered = ret.mutable_mat()(roi);
+            cv::addWeighted(covered, 1 - other_weight, other.img(cv::Rect(cv::Point(), roi.size())), other_weight, 0.0, covered);
+            return ret;
+        }
+
+        BlendParams params;
+        params.weight = other_weight;
+        ret = *this;
+        blend_into(ret.mutable_mat(), other.img, params);
+        return ret;
+    }
+
+    // returns this image with other composited at origin, per-pixel alpha
+    // from mask and/or other's alpha channel when given, scaled by weight
+    Image overlay(const Image& other, const cv::Point origin, const double weight = 1.0, const Image& mask = Image()) const {
+        IMGUTIL_TRACE_SPAN("Image::overlay");
+        BlendParams params;
+        params.weight = weight;
+        params.origin = origin;
+        Image ret(*this);
+        blend_into(ret.mutable_mat(), other.img, params, mask.img);
         return ret;
     }
 
-    // returns an image with pixels hot on edges and cold elsewhere
-    Image edge_detect(const int lower_threshold, const int upper_threshold) const {
+    // returns level n of this image's pyramid, this image halved n times;
+    // levels are built once and reused by every operation that targets them
+    Image pyramid_level(const int level, const PyramidMode mode = PyramidMode::GAUSSIAN) const {
+        IMGUTIL_TRACE_SPAN("Image::pyramid_level");
+        return Image(level_mat(level, mode));
+    }
+
+    // the deepest pyramid level whose sides are still at least min_size
+    int pyramid_level_for(const cv::Size& min_size) const {
+        return ImagePyramid::level_for(img.size(), min_size);
+    }
+
+    // returns an image with pixels hot on edges and cold elsewhere, computed
+    // on the given pyramid level and at its resolution
+    Image edge_detect(const int lower_threshold, const int upper_threshold, const int level = 0) const {
+        IMGUTIL_TRACE_SPAN("Image::edge_detect");
         Image ret;
-        cv::Canny(img, ret.img, lower_threshold, upper_threshold);
+        cv::Canny(level_mat(level), ret.img, lower_threshold, upper_threshold);
         return ret;
     }
 
-    // returns the result of blurring this image
-    Image gaussian_blur(const int kernel_sz) const {
+    // returns the result of blurring this image; with level > 0 the blur
+    // runs on that pyramid level with the kernel shrunk to match and is
+    // scaled back up, so large kernels cost a fraction of the full blur
+    Image gaussian_blur(const int kernel_sz, const int level = 0) const {
+        IMGUTIL_TRACE_SPAN("Image::gaussian_blur");
         debug_assert(kernel_sz % 2, "Kernel size must be an odd number");
         debug_assert(kernel_sz > 1, "Kernel size must be greater than 1");
         debug_assert(kernel_sz < 1000, "Kernel size must be less than 1000");
 
         Image ret;
-        cv::GaussianBlur(img, ret.img, cv::Size(kernel_sz, kernel_sz), 0);
+        if (level <= 0) {
+            cv::GaussianBlur(img, ret.img, cv::Size(kernel_sz, kernel_sz), 0);
+            return ret;
+        }
+
+        // the level is shared with the cache, blur into a separate buffer;
+        // small images stop at a shallower level than asked, scale the
+        // kernel by the level actually returned
+        cv::Mat small = level_mat(level);
+        const int level_kernel = (kernel_sz >> ImagePyramid::level_of(img.size(), small.size())) | 1;
+        if (level_kernel > 1) {
+            cv::Mat blurred;
+            cv::GaussianBlur(small, blurred, cv::Size(level_kernel, level_kernel), 0);
+            small = blurred;
+        }
+        cv::resize(small, ret.img, img.size(), 0, 0, cv::INTER_LINEAR);
         return ret;
     }
 
@@ -113,63 +269,63 @@ public:
 
     // returns the homography of a subimage of this image, needs 4 points to define subimage
     Image create_homography(const std::vector<cv::Point>& points) const {
+        IMGUTIL_TRACE_SPAN("Image::create_homography");
         debug_assert(points.size() == 4, "Exactly 4 points must be given");
 
         const std::vector<cv::Point> dst_points = {
             cv::Point(0,        0),
             cv::Point(img.cols, 0),
-            cv::Point(img.rows  , img.rows),
+            cv::Point(img.cols  , img.rows),
             cv::Point(0         , img.rows),
         };
 
-        cv::Mat tmp = cv::findHomography(points, dst_points);
+        // remap tables are cached per point set, repeated warps only remap
+        const auto warp = shared_warp_cache().get(points, dst_points, img.size());
         Image ret;
-        cv::warpPerspective(img, ret.img, tmp, img.size());
+        warp->apply(img, ret.img);
 
         return ret;
     }
 
+    // returns the number of pixels enclosed by these points
     int get_0th_moment(const std::vector<cv::Point>& points) const{
-        cv::Mat mask(img.rows, img.cols, CV_8UC3, cv::Scalar(0,0,0));
-        int sz = points.size();
-        cv::Point pnts[sz];
-        for(int i=0; i<sz; i++){
-            pnts[i] = points[i];
-        }
-        cv::fillConvexPoly(mask, pnts, sz, cv::Scalar(255, 255, 255));
-        imshow("Mask", mask);
-        cv::Mat gray; cv::cvtColor(mask, gray, cv::COLOR_BGR2GRAY);
-        int Area = cv::countNonZero(gray);
-        return Area;
+        return RegionAnalyzer::area(points, img.size());
     }
 
-    // returns the mean of these points
+    // returns the centre of mass of the area enclosed by these points
     static cv::Point get_1st_moment(const std::vector<cv::Point>& points) {
-        int sum_x = 0, sum_y = 0;
-
-        for (const cv::Point& point : points) {
-            sum_x += point.x;
-            sum_y += point.y;
-        }
+        const cv::Point2d c = RegionAnalyzer::polygon_centroid(points);
+        return cv::Point(cvRound(c.x), cvRound(c.y));
+    }
 
-        return cv::Point(sum_x / points.size(), sum_y / points.size());
+    // returns area, centroid, mean colour and second moments of the enclosed region
+    RegionStats region_stats(const std::vector<cv::Point>& points) const {
+        IMGUTIL_TRACE_SPAN("Image::region_stats");
+        return RegionAnalyzer(img).stats(points);
     }
 
-    Image get_mask(const std::vector<cv::Point>& points) const {
+    // returns the statistics of a rectangular region, touching only its pixels
+    RegionStats region_stats(const cv::Rect& roi) const {
+        IMGUTIL_TRACE_SPAN("Image::region_stats");
+        return RegionAnalyzer(img).stats(roi);
+    }
 
-        //create mask
-        int sz = points.size();
-        cv::Point pnts[sz];
-        for(int i=0; i<sz; i++){
-            pnts[i] = points[i];
-        }
-        cv::Mat mask(img.rows, img.cols, CV_8UC3, cv::Scalar(0,0,0));
-        cv::fillConvexPoly(mask, pnts, sz, cv::Scalar(255, 255, 255));
+    // returns the statistics of many regions, sharing one integral image
+    std::vector<RegionStats> region_stats(const std::vector<std::vector<cv::Point>>& polygons) const {
+        IMGUTIL_TRACE_SPAN("Image::region_stats");
+        return RegionAnalyzer(img).stats(polygons);
+    }
 
-        //combine mask and portion of image
-        cv::Mat ret; cv::bitwise_and(mask, img, ret);
+    // returns this image with everything outside of the polygon set to zero,
+    // only the pixels inside the polygon are read
+    Image get_mask(const std::vector<cv::Point>& points) const {
+        IMGUTIL_TRACE_SPAN("Image::get_mask");
+        std::vector<ScanSpan> spans;
+        polygon_spans(points, img.size(), spans);
 
-        return Image(ret);
+        Image ret(cv::Mat::zeros(img.size(), img.type()));
+        copy_spans(img, ret.img, spans);
+        return ret;
     }
 
     // return the result of projecting specified portion of other
@@ -178,35 +334,35 @@ public:
         const Image& other,
         const std::vector<cv::Point>& other_points,
         const std::vector<cv::Point>& this_points) const {
+        IMGUTIL_TRACE_SPAN("Image::proj_img");
         debug_assert(this_points.size() == 4, "Exactly 4 points must be given");
         debug_assert(other_points.size() == 4, "Exactly 4 points must be given");
-        Image ret(img);
+        Image ret(*this);
 
-        // mask out the projection site on dst
-        cv::fillConvexPoly(ret.img, this_points.data(), 4, cv::Scalar(0, 0, 0));
+        // rasterise the projection site, only its bounding box is warped
+        std::vector<ScanSpan> spans;
+        polygon_spans(this_points, img.size(), spans);
+        const cv::Rect roi = spans_bounding_rect(spans);
+        if (roi.empty()) return ret;
 
-        // mask out the rest of src
-        cv::Mat src(other.img.rows, other.img.cols, CV_8UC3, cv::Scalar(0, 0, 0));
-        cv::fillConvexPoly(src, other_points.data(), 4, cv::Scalar(255, 255, 255));
-        cv::bitwise_and(src, other.img, src);
+        // homography from other straight into the coordinates of the roi
+        const cv::Mat shift = (cv::Mat_<double>(3, 3) << 1, 0, -roi.x, 0, 1, -roi.y, 0, 0, 1);
+        const cv::Mat h = shift * cv::findHomography(other_points, this_points);
 
-        // project src cutout onto dst cutout
-        cv::warpPerspective(
-            src,
-            src,
-            cv::findHomography(other_points, this_points),
-            img.size()
-        );
-
-        // combine the cutouts into the output
-        cv::bitwise_or(ret.img, src, ret.img);
+        // pixels inside the site map back inside the cutout on other,
+        // so other needs no masking of its own
+        cv::Mat patch;
+        cv::warpPerspective(other.img, patch, h, roi.size());
 
+        copy_spans(patch, ret.mutable_mat(), spans, roi.tl());
         return ret;
     }
 
     // return the grayscale version of this image
     Image grayscale() const {
+        IMGUTIL_TRACE_SPAN("Image::grayscale");
         Image ret;
+        if (typed_grayscale(img, ret.img, 3)) return ret;
         cv::cvtColor(img, ret.img, cv::COLOR_BGR2GRAY);
         cvtColor(ret.img, ret.img, cv::COLOR_GRAY2RGB);
         return ret;
@@ -214,140 +370,65 @@ public:
 
     // threshold this image with one of the given types using some threshold value
     Image threshold(const int type, const int value) const {
+        IMGUTIL_TRACE_SPAN("Image::threshold");
         debug_assert(type >= 1, "Threshold type must be at least 1");
         debug_assert(type <= 5, "Threshold type must be at most 5");
         debug_assert(value >= 0, "Threshold value must be non-negative");
         debug_assert(value < 256, "Threshold value must be less than 256");
 
         Image ret;
+        if (typed_threshold(img, ret.img, value, 255, type)) return ret;
         cv:: threshold(img ,ret.img, value, 255, type );
         return ret;
     }
 
-
-// ------------------------- 1.0 Additional Implementation
-private:
-
-    struct Detection{
-        int labelId;
-        float confidence;
-        cv::Rect box;
-    };
-
-    std::vector<std::string> loadClassifications() const{
-        std::vector<std::string> classes;
-        std::ifstream ifs("model/classes.txt");
-        std::string line;
-        while (getline(ifs, line)){
-            classes.push_back(line);
-        }    
-        return classes;
+    // map every 8-bit value through a 256-entry table
+    Image lut(const cv::Mat& table) const {
+        IMGUTIL_TRACE_SPAN("Image::lut");
+        Image ret;
+        if (typed_lut(img, ret.img, table)) return ret;
+        cv::LUT(img, table, ret.img);
+        return ret;
     }
 
-    cv::dnn::Net loadDNN() const{
-        cv::dnn::Net nn; nn = cv::dnn::readNet("model/yolov5s.onnx");
-        nn.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
-        nn.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
-        return nn;
+    // threshold with the extended engine (Otsu, triangle, adaptive), returns a single channel image
+    Image threshold(const ThresholdParams& params) const {
+        IMGUTIL_TRACE_SPAN("Image::threshold");
+        ThresholdEngine engine(params);
+        Image ret;
+        engine.apply(img, ret.img);
+        return ret;
     }
 
-    cv::Mat formatInput(cv::Mat &image) const{
-        int row = image.rows; 
-        int col = image.cols;
-        int sides = MAX(col, row);
-        cv::Mat input; input = cv::Mat::zeros(sides, sides, CV_8UC3);
-        image.copyTo(input(cv::Rect(0,0,col,row)));
-        return input;
-    }
 
-    std::vector<Detection> obtainOutput(cv::dnn::Net &net, cv::Mat &input, const std::vector<std::string> labels) const{
-        const float INPUT_SIDES = 640.0;
-        const float SCORE_THRESHOLD = 0.2;
-        const float NMS_THRESHOLD = 0.4;
-        const float CONFIDENCE_THRESHOLD = 0.4;
-
-        cv::Mat blob;
-        cv::dnn::blobFromImage(input, blob, 1./255., cv::Size(INPUT_SIDES, INPUT_SIDES), cv::Scalar(), true, false);
-        net.setInput(blob);
-
-        std::vector<cv::Mat> outputs;
-        net.forward(outputs, net.getUnconnectedOutLayersNames());
-        
-        // Scaling factor from input image to blob input
-        float x_factor = input.cols / INPUT_SIDES;
-        float y_factor = input.rows / INPUT_SIDES;
-        // extract detection data
-        float *data = (float *)outputs[0].data;
-
-        std::vector<int> labelIds;
-        std::vector<float> confidences;
-        std::vector<cv::Rect> boxes;
-        const int ROWS = 25200;
-        for (int i = 0; i < ROWS; ++i) {
-
-            float confidence = data[4];
-            if (confidence >= CONFIDENCE_THRESHOLD) {
-
-                float * label_scores = data + 5;
-                cv::Mat scores(1, labels.size(), CV_32FC1, label_scores);
-                cv::Point labelId;
-                double max_label_score;
-                minMaxLoc(scores, 0, &max_label_score, 0, &labelId);
-                if (max_label_score > SCORE_THRESHOLD) {
-                    float x = data[0];
-                    float y = data[1];
-                    float w = data[2];
-                    float h = data[3];
-                    int left = int((x - 0.5 * w) * x_factor);
-                    int top = int((y - 0.5 * h) * y_factor);
-                    int width = int(w * x_factor);
-                    int height = int(h * y_factor);
-
-                    boxes.push_back(cv::Rect(left, top, width, height));
-                    confidences.push_back(confidence);
-                    labelIds.push_back(labelId.x);
-                }
-            }
-            data += 85;
-        }
+// ------------------------- 1.0 Additional Implementation
 
-        // suppress overlapping boxes/detections with Non-maximal supression
-        std::vector<Detection> output;
-        std::vector<int> nms_result;
-        cv::dnn::NMSBoxes(boxes, confidences, SCORE_THRESHOLD, NMS_THRESHOLD, nms_result);
-        for (int i = 0; i < nms_result.size(); i++) {
-            int idx = nms_result[i];
-            Detection result;
-            result.labelId = labelIds[idx];
-            result.confidence = confidences[idx];
-            result.box = boxes[idx];
-            output.push_back(result);
+    // returns this image with YOLOv5 detections drawn on it; with level > 0
+    // the net sees that pyramid level and boxes are scaled back to full size
+    Image detection(const DetectorParams& params = DetectorParams(), const int level = 0) const{
+        IMGUTIL_TRACE_SPAN("Image::detection");
+        Image ret(*this);
+        // uses the preloaded net when preload_detector was called with params
+        DetectorLease detector(params);
+        const cv::Mat input = level_mat(level);
+        std::vector<Detection> output = detector->detect(input);
+        if (input.size() != img.size()) {
+            const double sx = double(img.cols) / input.cols;
+            const double sy = double(img.rows) / input.rows;
+            for (Detection& d : output)
+                d.box = cv::Rect(cvRound(d.box.x * sx), cvRound(d.box.y * sy), cvRound(d.box.width * sx), cvRound(d.box.height * sy));
         }
-        return output;
-    }
-
-    void putDetection(std::vector<Detection> &output, cv::Mat &frame, const std::vector<std::string> labels) const{
-        const std::vector<cv::Scalar> colors = {cv::Scalar(255, 255, 0), cv::Scalar(0, 255, 0), cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 0)};
-        for (int i = 0; i < output.size(); ++i){
-                auto detection = output[i];
-                auto box = detection.box;
-                auto labelId = detection.labelId;
-                const auto color = colors[labelId % colors.size()];
-                cv::rectangle(frame, box, color, 3);
-                cv::rectangle(frame, cv::Point(box.x, box.y - 20), cv::Point(box.x + box.width, box.y), color, cv::FILLED);
-                cv::putText(frame, labels[labelId].c_str(), cv::Point(box.x, box.y - 5), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 0));
-            }
+        detector->draw(output, ret.mutable_mat());
+        return ret;
     }
 
-public:
-    Image detection() const{
-        cv::Mat ret = img;
-        std::vector<std::string> label = Image::loadClassifications();
-        cv::dnn::Net net = Image::loadDNN();
-        cv::Mat input; input = Image::formatInput(ret);
-        std::vector<Detection> output; output = Image::obtainOutput(net, input, label);
-        Image::putDetection(output, ret, label); 
-        return Image(ret);
+    // detection through a shared InferenceServer, batched with concurrent callers
+    Image detection(InferenceServer& server) const{
+        IMGUTIL_TRACE_SPAN("Image::detection");
+        Image ret(*this);
+        std::vector<Detection> output = server.submit(img).get();
+        server.draw(output, ret.mutable_mat());
+        return ret;
     }
 
 };
\ No newline at end of file
@@ -0,0 +1,230 @@
+//
+// Typed views over cv::Mat and compile-time specialised pointwise kernels
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <type_traits>
+
+#include "Blend.h"
+
+
+// Above this many pixels the typed kernels are not used: OpenCV's own
+// implementations are multithreaded and the per-call dispatch they pay is
+// negligible next to the work. Below it the dispatch dominates.
+#ifndef IMGUTIL_TYPED_KERNEL_MAX_PIXELS
+#define IMGUTIL_TYPED_KERNEL_MAX_PIXELS (256 * 256)
+#endif
+
+// A cv::Mat seen as rows of C-channel pixels of type T, both fixed at
+// compile time, so kernels over it inline into plain pointer loops the
+// compiler can vectorise. T may be const for read-only views. The view
+// does not own or reference count the data.
+template <typename T, int C>
+class ImageView {
+
+    using Element = std::remove_const_t<T>;
+
+    uchar* data;
+    size_t step;
+    int rows_, cols_;
+
+public:
+
+    using value_type = T;
+    static constexpr int channels = C;
+
+    static bool matches(const cv::Mat& m) {
+        return m.depth() == cv::traits::Depth<Element>::value && m.channels() == C;
+    }
+
+    explicit ImageView(const cv::Mat& m) : data(m.data), step(m.step), rows_(m.rows), cols_(m.cols) {
+        CV_Assert(matches(m));
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    // elements in a row, cols * channels
+    int row_elements() const { return cols_ * C; }
+
+    T* row(const int y) const { return reinterpret_cast<T*>(data + y * step); }
+};
+
+// BGR to gray with OpenCV's BT.601 weights, the gray value repeated over
+// the Cout output channels; bit-exact with cv::cvtColor for uchar
+template <typename T, int Cout>
+static void grayscale_kernel(const ImageView<const T, 3>& src, const ImageView<T, Cout>& dst) {
+    for (int y = 0; y < src.rows(); ++y) {
+        const T* s = src.row(y);
+        T* d = dst.row(y);
+        for (int x = 0; x < src.cols(); ++x) {
+            T g;
+            if constexpr (std::is_same_v<T, uchar>)
+                g = uchar((s[3 * x] * 1868 + s[3 * x + 1] * 9617 + s[3 * x + 2] * 4899 + (1 << 13)) >> 14);
+            else
+                g = T(0.114f * s[3 * x] + 0.587f * s[3 * x + 1] + 0.299f * s[3 * x + 2]);
+            for (int c = 0; c < Cout; ++c) d[x * Cout + c] = g;
+        }
+    }
+}
+
+// one 8-bit row of cv::threshold, the type switch outside the loops so
+// each of them vectorises to compares and blends
+static IMGUTIL_ALWAYS_INLINE void threshold_row_u8_impl(const uchar* s, uchar* d, const int n, const uchar t, const uchar m, const int type) {
+    switch (type) {
+        case cv::THRESH_BINARY: for (int i = 0; i < n; ++i) d[i] = s[i] > t ? m : 0; break;
+        case cv::THRESH_BINARY_INV: for (int i = 0; i < n; ++i) d[i] = s[i] > t ? 0 : m; break;
+        case cv::THRESH_TRUNC: for (int i = 0; i < n; ++i) d[i] = s[i] > t ? t : s[i]; break;
+        case cv::THRESH_TOZERO: for (int i = 0; i < n; ++i) d[i] = s[i] > t ? s[i] : 0; break;
+        default: for (int i = 0; i < n; ++i) d[i] = s[i] > t ? 0 : s[i]; break;
+    }
+}
+IMGUTIL_KERNEL_VARIANTS(threshold_row_u8, (const uchar* s, uchar* d, const int n, const uchar t, const uchar m, const int type), (s, d, n, t, m, type))
+
+// cv::threshold semantics for one threshold type, every channel alike
+template <int Type, typename T, int C>
+static void threshold_kernel(const ImageView<const T, C>& src, const ImageView<T, C>& dst, const T thresh, const T maxval) {
+    const int n = src.row_elements();
+    for (int y = 0; y < src.rows(); ++y) {
+        const T* s = src.row(y);
+        T* d = dst.row(y);
+        if constexpr (std::is_same_v<T, uchar>) {
+            threshold_row_u8(s, d, n, thresh, maxval, Type);
+        } else {
+            for (int i = 0; i < n; ++i) {
+                const bool above = s[i] > thresh;
+                if constexpr (Type == cv::THRESH_BINARY) d[i] = above ? maxval : T(0);
+                else if constexpr (Type == cv::THRESH_BINARY_INV) d[i] = above ? T(0) : maxval;
+                else if constexpr (Type == cv::THRESH_TRUNC) d[i] = above ? thresh : s[i];
+                else if constexpr (Type == cv::THRESH_TOZERO) d[i] = above ? s[i] : T(0);
+                else d[i] = above ? T(0) : s[i];
+            }
+        }
+    }
+}
+
+// table lookup of every 8-bit element
+template <int C>
+static void lut_kernel(const ImageView<const uchar, C>& src, const ImageView<uchar, C>& dst, const uchar* table) {
+    const int n = src.row_elements();
+    for (int y = 0; y < src.rows(); ++y) {
+        const uchar* s = src.row(y);
+        uchar* d = dst.row(y);
+        for (int i = 0; i < n; ++i) d[i] = table[s[i]];
+    }
+}
+
+// dst = a * (1 - weight) + b * weight, 8.8 fixed point for uchar as in Blend.h
+template <typename T, int C>
+static void blend_kernel(const ImageView<const T, C>& a, const ImageView<const T, C>& b, const ImageView<T, C>& dst, const double weight) {
+    const int n = a.row_elements();
+    for (int y = 0; y < a.rows(); ++y) {
+        const T* pa = a.row(y);
+        const T* pb = b.row(y);
+        T* d = dst.row(y);
+        if constexpr (std::is_same_v<T, uchar>) {
+            const ushort w = blend_alpha(weight);
+            const ushort iw = 256 - w;
+            for (int i = 0; i < n; ++i) d[i] = uchar((pa[i] * iw + pb[i] * w + 128) >> 8);
+        } else {
+            const T w = T(weight);
+            for (int i = 0; i < n; ++i) d[i] = pa[i] + (pb[i] - pa[i]) * w;
+        }
+    }
+}
+
+// ---- runtime dispatch from cv::Mat onto the typed kernels. Each returns
+// false, leaving dst alone, when the type has no kernel or the image is
+// big enough for OpenCV's own path to win; callers then fall back.
+
+static bool typed_kernel_applies(const cv::Mat& m) {
+    return !m.empty() && m.dims == 2 && m.total() <= size_t(IMGUTIL_TYPED_KERNEL_MAX_PIXELS);
+}
+
+// BGR to gray, dst_channels 1 or 3 (gray repeated)
+static bool typed_grayscale(const cv::Mat& src, cv::Mat& dst, const int dst_channels) {
+    if (!typed_kernel_applies(src) || (dst_channels != 1 && dst_channels != 3)) return false;
+    cv::Mat out;
+    switch (src.type()) {
+        case CV_8UC3:
+            out.create(src.size(), CV_MAKETYPE(CV_8U, dst_channels));
+            if (dst_channels == 1) grayscale_kernel(ImageView<const uchar, 3>(src), ImageView<uchar, 1>(out));
+            else grayscale_kernel(ImageView<const uchar, 3>(src), ImageView<uchar, 3>(out));
+            break;
+        case CV_32FC3:
+            out.create(src.size(), CV_MAKETYPE(CV_32F, dst_channels));
+            if (dst_channels == 1) grayscale_kernel(ImageView<const float, 3>(src), ImageView<float, 1>(out));
+            else grayscale_kernel(ImageView<const float, 3>(src), ImageView<float, 3>(out));
+            break;
+        default:
+            return false;
+    }
+    dst = out;
+    return true;
+}
+
+template <typename T, int C>
+static bool typed_threshold_as(const cv::Mat& src, cv::Mat& dst, const T thresh, const T maxval, const int type) {
+    const ImageView<const T, C> s(src);
+    const ImageView<T, C> d(dst);
+    switch (type) {
+        case cv::THRESH_BINARY: threshold_kernel<cv::THRESH_BINARY>(s, d, thresh, maxval); return true;
+        case cv::THRESH_BINARY_INV: threshold_kernel<cv::THRESH_BINARY_INV>(s, d, thresh, maxval); return true;
+        case cv::THRESH_TRUNC: threshold_kernel<cv::THRESH_TRUNC>(s, d, thresh, maxval); return true;
+        case cv::THRESH_TOZERO: threshold_kernel<cv::THRESH_TOZERO>(s, d, thresh, maxval); return true;
+        case cv::THRESH_TOZERO_INV: threshold_kernel<cv::THRESH_TOZERO_INV>(s, d, thresh, maxval); return true;
+        default: return false;
+    }
+}
+
+// cv::threshold for the five basic types on 8-bit or float, 1 or 3 channels
+static bool typed_threshold(const cv::Mat& src, cv::Mat& dst, const double thresh, const double maxval, const int type) {
+    if (!typed_kernel_applies(src) || type < cv::THRESH_BINARY || type > cv::THRESH_TOZERO_INV) return false;
+    cv::Mat out(src.size(), src.type());
+    // 8-bit thresholds compare against the floor, as cv::threshold does
+    const uchar t8 = cv::saturate_cast<uchar>(cvFloor(thresh));
+    const uchar m8 = cv::saturate_cast<uchar>(maxval);
+    bool done = false;
+    switch (src.type()) {
+        case CV_8UC1: done = typed_threshold_as<uchar, 1>(src, out, t8, m8, type); break;
+        case CV_8UC3: done = typed_threshold_as<uchar, 3>(src, out, t8, m8, type); break;
+        case CV_32FC1: done = typed_threshold_as<float, 1>(src, out, float(thresh), float(maxval), type); break;
+        case CV_32FC3: done = typed_threshold_as<float, 3>(src, out, float(thresh), float(maxval), type); break;
+        default: break;
+    }
+    if (!done) return false;
+    dst = out;
+    return true;
+}
+
+// cv::LUT with a 256-entry CV_8UC1 table on 8-bit images of 1, 3 or 4 channels
+static bool typed_lut(const cv::Mat& src, cv::Mat& dst, const cv::Mat& table) {
+    if (!typed_kernel_applies(src) || table.type() != CV_8UC1 || table.total() != 256 || !table.isContinuous()) return false;
+    cv::Mat out(src.size(), src.type());
+    const uchar* t = table.ptr<uchar>();
+    switch (src.type()) {
+        case CV_8UC1: lut_kernel(ImageView<const uchar, 1>(src), ImageView<uchar, 1>(out), t); break;
+        case CV_8UC3: lut_kernel(ImageView<const uchar, 3>(src), ImageView<uchar, 3>(out), t); break;
+        case CV_8UC4: lut_kernel(ImageView<const uchar, 4>(src), ImageView<uchar, 4>(out), t); break;
+        default: return false;
+    }
+    dst = out;
+    return true;
+}
+
+// a * (1 - weight) + b * weight for same sized, same typed images
+static bool typed_blend(const cv::Mat& a, const cv::Mat& b, const double weight, cv::Mat& dst) {
+    if (!typed_kernel_applies(a) || a.size() != b.size() || a.type() != b.type()) return false;
+    cv::Mat out(a.size(), a.type());
+    switch (a.type()) {
+        case CV_8UC1: blend_kernel(ImageView<const uchar, 1>(a), ImageView<const uchar, 1>(b), ImageView<uchar, 1>(out), weight); break;
+        case CV_8UC3: blend_kernel(ImageView<const uchar, 3>(a), ImageView<const uchar, 3>(b), ImageView<uchar, 3>(out), weight); break;
+        case CV_32FC1: blend_kernel(ImageView<const float, 1>(a), ImageView<const float, 1>(b), ImageView<float, 1>(out), weight); break;
+        case CV_32FC3: blend_kernel(ImageView<const float, 3>(a), ImageView<const float, 3>(b), ImageView<float, 3>(out), weight); break;
+        default: return false;
+    }
+    dst = out;
+    return true;
+}
@@ -0,0 +1,132 @@
+//
+// In-process inference service batching detection requests across threads
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Detector.h"
+
+
+struct InferenceServerParams {
+    DetectorParams detector;
+    int instances = 2;          // pre-loaded nets, each served by its own thread
+    int max_batch = 8;          // requests run through one forward pass at most
+    double max_wait_ms = 5;     // how long a request may wait for others to join its batch
+};
+
+// A pool of pre-loaded Detectors behind one request queue. Concurrent
+// submit() calls are gathered into batches of up to max_batch frames, or
+// whatever arrived within max_wait_ms of the first, and run through a single
+// forward pass on whichever net is free. Callers get a future each.
+class InferenceServer {
+
+    struct Request {
+        cv::Mat frame;
+        std::promise<std::vector<Detection>> promise;
+    };
+
+    InferenceServerParams params;
+    std::vector<std::string> labels;
+    std::deque<Request> queue;
+    std::mutex mutex;
+    std::condition_variable queued;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void serve(Detector& detector) {
+        using Clock = std::chrono::steady_clock;
+        const auto max_wait = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(params.max_wait_ms));
+
+        while (true) {
+            std::vector<Request> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+
+                // give other callers until the deadline to fill the batch
+                const auto deadline = Clock::now() + max_wait;
+                while (!stopping && int(queue.size()) < params.max_batch)
+                    if (queued.wait_until(lock, deadline) == std::cv_status::timeout) break;
+
+                const size_t n = std::min<size_t>(queue.size(), params.max_batch);
+                for (size_t i = 0; i < n; ++i) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+            // there may be enough left for another worker to start on
+            queued.notify_one();
+
+            IMGUTIL_TRACE_SPAN("InferenceServer::batch");
+            std::vector<cv::Mat> frames;
+            for (const Request& r : batch) frames.push_back(r.frame);
+            try {
+                std::vector<std::vector<Detection>> results = detector.detect_batch(frames);
+                for (size_t i = 0; i < batch.size(); ++i)
+                    batch[i].promise.set_value(std::move(results[i]));
+            } catch (...) {
+                for (Request& r : batch)
+                    r.promise.set_exception(std::current_exception());
+            }
+        }
+    }
+
+public:
+
+    // loads every net up front, so the first request does not pay for it
+    InferenceServer(const InferenceServerParams& _params = InferenceServerParams())
+        : params(_params), labels(Detector::load_classes(_params.detector.classes_path)) {
+        // load every net before starting any thread, a failed load then
+        // leaves nothing running
+        std::vector<std::shared_ptr<Detector>> detectors;
+        for (int i = 0; i < std::max(params.instances, 1); ++i)
+            detectors.push_back(std::make_shared<Detector>(params.detector));
+        for (const auto& detector : detectors)
+            workers.emplace_back([this, detector] { serve(*detector); });
+    }
+
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+
+    // finishes the requests already queued, then stops
+    ~InferenceServer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    // queue a frame for detection; the frame is shared, not copied, so the
+    // caller must not write to it until the future is ready
+    std::future<std::vector<Detection>> submit(const cv::Mat& frame) {
+        Request request;
+        request.frame = frame;
+        std::future<std::vector<Detection>> ret = request.promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(request));
+        }
+        queued.notify_one();
+        return ret;
+    }
+
+    const std::vector<std::string>& classes() const { return labels; }
+
+    void draw(const std::vector<Detection>& output, cv::Mat& frame) const {
+        draw_detections(output, frame, labels);
+    }
+};
@@ -0,0 +1,70 @@
+//
+// Model manifest: the detection model variants available to load
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <iostream>
+
+#include "Detector.h"
+
+
+struct UnknownModelErr {};
+
+// one line of the manifest
+struct ModelSpec {
+    std::string name;
+    std::string path;
+    int input_size = 640;
+    std::string precision;      // fp32, fp16 or int8, informational; OpenCV reads quantised ONNX as is
+    std::string classes_path;
+};
+
+// Reads a manifest of whitespace separated lines
+//     name  file  input_size  precision  classes_file
+// blank lines and lines starting with # are skipped.
+static std::vector<ModelSpec> load_model_manifest(const std::string& path = "model/models.txt") {
+    std::vector<ModelSpec> ret;
+    std::ifstream ifs(path);
+    std::string line;
+    while (getline(ifs, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        ModelSpec spec;
+        if (fields >> spec.name >> spec.path >> spec.input_size >> spec.precision >> spec.classes_path)
+            ret.push_back(spec);
+    }
+    return ret;
+}
+
+static ModelSpec find_model(const std::string& name, const std::string& manifest = "model/models.txt") {
+    for (const ModelSpec& spec : load_model_manifest(manifest))
+        if (spec.name == name) return spec;
+
+    std::cerr << "Model " << name << " is not listed in " << manifest << std::endl;
+    throw UnknownModelErr{};
+}
+
+// detector parameters for a manifest entry; the output shape is checked
+// against the decoder when the Detector is built
+static DetectorParams detector_params_for(const ModelSpec& spec) {
+    DetectorParams params;
+    params.model_path = spec.path;
+    params.classes_path = spec.classes_path;
+    params.input_width = spec.input_size;
+    params.input_height = spec.input_size;
+    params.validate_model = true;
+    return params;
+}
+
+// the model named by IMGUTIL_MODEL, or the default parameters when unset
+static DetectorParams detector_params_from_env(const std::string& manifest = "model/models.txt") {
+    const char* name = std::getenv("IMGUTIL_MODEL");
+    if (!name) return DetectorParams();
+    return detector_params_for(find_model(name, manifest));
+}
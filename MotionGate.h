@@ -0,0 +1,93 @@
+//
+// Background subtraction gate deciding where, if anywhere, to run detection
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+
+struct MotionParams {
+    bool use_knn = false;           // KNN instead of MOG2 background subtraction
+    int scale = 4;                  // subtraction runs at 1/scale resolution
+    int history = 500;
+    double var_threshold = 16;      // MOG2 squared Mahalanobis distance threshold
+    double dist2_threshold = 400;   // KNN squared distance threshold
+    double min_area_ratio = 0.0005; // ignore blobs smaller than this share of the frame
+    int padding = 32;               // context around each moving region, full resolution pixels
+    double full_frame_ratio = 0.6;  // when regions cover more than this, use the whole frame
+};
+
+// Finds moving regions with background subtraction on a downscaled frame.
+// An empty result means nothing moved and inference can be skipped.
+class MotionGate {
+
+    MotionParams params;
+    cv::Ptr<cv::BackgroundSubtractor> subtractor;
+    cv::Mat small, fg;
+    const cv::Mat kernel = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
+
+    // merge overlapping rectangles until none overlap
+    static void merge_rects(std::vector<cv::Rect>& rects) {
+        bool merged = true;
+        while (merged) {
+            merged = false;
+            for (size_t i = 0; i < rects.size() && !merged; ++i) {
+                for (size_t j = i + 1; j < rects.size(); ++j) {
+                    if ((rects[i] & rects[j]).area() > 0) {
+                        rects[i] |= rects[j];
+                        rects.erase(rects.begin() + j);
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+public:
+
+    MotionGate(const MotionParams& _params = MotionParams()) : params(_params) {
+        if (params.use_knn)
+            subtractor = cv::createBackgroundSubtractorKNN(params.history, params.dist2_threshold, false);
+        else
+            subtractor = cv::createBackgroundSubtractorMOG2(params.history, params.var_threshold, false);
+    }
+
+    // update the background model with frame, returns full resolution
+    // rectangles around the moving regions
+    std::vector<cv::Rect> update(const cv::Mat& frame) {
+        cv::resize(frame, small, cv::Size(frame.cols / params.scale, frame.rows / params.scale), 0, 0, cv::INTER_AREA);
+        subtractor->apply(small, fg);
+
+        // drop speckle noise, then join nearby fragments of the same object
+        cv::threshold(fg, fg, 200, 255, cv::THRESH_BINARY);
+        cv::morphologyEx(fg, fg, cv::MORPH_OPEN, kernel);
+        cv::dilate(fg, fg, kernel, cv::Point(-1, -1), 2);
+
+        std::vector<std::vector<cv::Point>> contours;
+        cv::findContours(fg, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+
+        const double min_area = params.min_area_ratio * small.total();
+        const cv::Rect bounds(cv::Point(), frame.size());
+        std::vector<cv::Rect> regions;
+        for (const auto& contour : contours) {
+            if (cv::contourArea(contour) < min_area) continue;
+            const cv::Rect r = cv::boundingRect(contour);
+            regions.push_back(cv::Rect(
+                r.x * params.scale - params.padding,
+                r.y * params.scale - params.padding,
+                r.width * params.scale + 2 * params.padding,
+                r.height * params.scale + 2 * params.padding) & bounds);
+        }
+        merge_rects(regions);
+
+        double covered = 0;
+        for (const cv::Rect& r : regions) covered += r.area();
+        if (covered > params.full_frame_ratio * bounds.area())
+            return {bounds};
+        return regions;
+    }
+};
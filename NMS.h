@@ -0,0 +1,160 @@
+//
+// Non-maximum suppression over detection boxes
+//
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+
+#include "CpuDispatch.h"
+
+
+struct NmsParams {
+    float iou_threshold = 0.4;
+    float score_threshold = 0.2;    // candidates below this are dropped, also after soft decay
+    int top_k = 0;                  // per class, only the top_k scores enter suppression; 0 = all
+    int max_detections = 300;       // cap on the merged result, 0 = no cap
+    bool class_aware = true;        // suppress only within the same class
+    bool soft = false;              // gaussian soft-NMS: decay overlapping scores instead of dropping
+    float soft_sigma = 0.5;
+};
+
+// Boxes of one class bucket as structure-of-arrays, in descending score
+// order, so the overlap loops run over contiguous floats and vectorise.
+struct NmsBucket {
+    std::vector<int> index;     // position in the caller's arrays
+    std::vector<float> x1, y1, x2, y2, area, score;
+
+    void reserve(const size_t n) {
+        index.reserve(n);
+        for (auto* v : {&x1, &y1, &x2, &y2, &area, &score}) v->reserve(n);
+    }
+
+    void push(const int i, const cv::Rect& box, const float s) {
+        index.push_back(i);
+        x1.push_back(box.x);
+        y1.push_back(box.y);
+        x2.push_back(box.x + box.width);
+        y2.push_back(box.y + box.height);
+        area.push_back(float(box.width) * box.height);
+        score.push_back(s);
+    }
+
+    int size() const { return index.size(); }
+};
+
+// overlap of box i with every box j in [begin, n), intersection-over-union into iou[j]
+static IMGUTIL_ALWAYS_INLINE void nms_iou_row_impl(const NmsBucket& b, const int i, const int begin, float* iou) {
+    const int n = b.size();
+    const float bx1 = b.x1[i], by1 = b.y1[i], bx2 = b.x2[i], by2 = b.y2[i], barea = b.area[i];
+    const float* x1 = b.x1.data();
+    const float* y1 = b.y1.data();
+    const float* x2 = b.x2.data();
+    const float* y2 = b.y2.data();
+    const float* area = b.area.data();
+    for (int j = begin; j < n; ++j) {
+        const float w = std::max(0.f, std::min(bx2, x2[j]) - std::max(bx1, x1[j]));
+        const float h = std::max(0.f, std::min(by2, y2[j]) - std::max(by1, y1[j]));
+        const float inter = w * h;
+        iou[j] = inter / std::max(barea + area[j] - inter, 1e-6f);
+    }
+}
+IMGUTIL_KERNEL_VARIANTS(nms_iou_row, (const NmsBucket& b, const int i, const int begin, float* iou), (b, i, begin, iou))
+
+// hard suppression of one bucket, appends the kept bucket positions
+static void nms_hard(const NmsBucket& b, const float iou_threshold, std::vector<int>& keep) {
+    const int n = b.size();
+    std::vector<uchar> removed(n, 0);
+    std::vector<float> iou(n);
+    for (int i = 0; i < n; ++i) {
+        if (removed[i]) continue;
+        keep.push_back(i);
+        nms_iou_row(b, i, i + 1, iou.data());
+        for (int j = i + 1; j < n; ++j)
+            removed[j] |= uchar(iou[j] > iou_threshold);
+    }
+}
+
+// gaussian soft suppression of one bucket; decays scores in place and
+// appends the kept bucket positions in the order they were selected
+static void nms_soft(NmsBucket& b, const float sigma, const float score_threshold, std::vector<int>& keep) {
+    const int n = b.size();
+    std::vector<uchar> done(n, 0);
+    std::vector<float> iou(n);
+    for (int step = 0; step < n; ++step) {
+        int best = -1;
+        for (int j = 0; j < n; ++j)
+            if (!done[j] && (best < 0 || b.score[j] > b.score[best])) best = j;
+        if (best < 0 || b.score[best] < score_threshold) break;
+
+        done[best] = 1;
+        keep.push_back(best);
+        nms_iou_row(b, best, 0, iou.data());
+        for (int j = 0; j < n; ++j)
+            if (!done[j]) b.score[j] *= std::exp(-(iou[j] * iou[j]) / sigma);
+    }
+}
+
+// Suppress overlapping boxes, per class unless class_aware is off. Returns
+// indices into boxes in descending score order; with soft-NMS the decayed
+// scores are written to out_scores (indexed like boxes) when given.
+static std::vector<int> nms(
+    const std::vector<cv::Rect>& boxes,
+    const std::vector<float>& scores,
+    const std::vector<int>& class_ids,
+    const NmsParams& params = NmsParams(),
+    std::vector<float>* out_scores = nullptr) {
+    CV_Assert(boxes.size() == scores.size() && boxes.size() == class_ids.size());
+
+    // bucket candidates by class, dropping the low scores up front
+    std::vector<std::vector<int>> by_class;
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (scores[i] < params.score_threshold) continue;
+        const int c = params.class_aware ? class_ids[i] : 0;
+        if (c >= int(by_class.size())) by_class.resize(c + 1);
+        by_class[c].push_back(i);
+    }
+
+    if (out_scores) *out_scores = scores;
+
+    std::vector<int> ret;
+    std::vector<int> keep;
+    for (std::vector<int>& members : by_class) {
+        if (members.empty()) continue;
+
+        auto by_score = [&](const int a, const int b) { return scores[a] > scores[b]; };
+        if (params.top_k > 0 && int(members.size()) > params.top_k) {
+            std::partial_sort(members.begin(), members.begin() + params.top_k, members.end(), by_score);
+            members.resize(params.top_k);
+        } else {
+            std::sort(members.begin(), members.end(), by_score);
+        }
+
+        NmsBucket bucket;
+        bucket.reserve(members.size());
+        for (const int i : members) bucket.push(i, boxes[i], scores[i]);
+
+        keep.clear();
+        if (params.soft)
+            nms_soft(bucket, params.soft_sigma, params.score_threshold, keep);
+        else
+            nms_hard(bucket, params.iou_threshold, keep);
+
+        for (const int k : keep) {
+            ret.push_back(bucket.index[k]);
+            if (out_scores) (*out_scores)[bucket.index[k]] = bucket.score[k];
+        }
+    }
+
+    // merge the classes back into one score order
+    const std::vector<float>& final_scores = out_scores ? *out_scores : scores;
+    std::stable_sort(ret.begin(), ret.end(), [&](const int a, const int b) { return final_scores[a] > final_scores[b]; });
+    if (params.max_detections > 0 && int(ret.size()) > params.max_detections)
+        ret.resize(params.max_detections);
+    return ret;
+}
@@ -0,0 +1,86 @@
+//
+// Lazily built multi-resolution pyramid of an image
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <mutex>
+#include <vector>
+
+
+enum class PyramidMode {
+    GAUSSIAN,   // cv::pyrDown, 5x5 gaussian then drop every other row and column
+    AREA        // INTER_AREA halving, box filtered, cheaper and slightly sharper
+};
+
+// Level n is the base image halved n times. Levels are built on first use,
+// each from the one above it, and kept until the base changes, so blurs,
+// edge maps and detection at several scales share the downsampling work.
+// The base is recognised by its buffer, not its contents, so after writing
+// to the base pixels in place call clear(). Safe to query from several threads.
+class ImagePyramid {
+
+    cv::Mat base;
+    std::vector<cv::Mat> levels[2];     // per PyramidMode, level 1 first
+    std::mutex mutex;
+
+    static bool same_image(const cv::Mat& a, const cv::Mat& b) {
+        return a.data == b.data && a.size() == b.size() && a.type() == b.type() && a.step == b.step;
+    }
+
+public:
+
+    // level n of image, clamped to the last level that is at least 1x1
+    cv::Mat level(const cv::Mat& image, const int n, const PyramidMode mode = PyramidMode::GAUSSIAN) {
+        if (n <= 0 || image.empty()) return image;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!same_image(base, image)) {
+            base = image;
+            for (auto& l : levels) l.clear();
+        }
+
+        std::vector<cv::Mat>& built = levels[int(mode)];
+        while (int(built.size()) < n) {
+            const cv::Mat& prev = built.empty() ? base : built.back();
+            if (prev.cols < 2 || prev.rows < 2) break;
+            const cv::Size half((prev.cols + 1) / 2, (prev.rows + 1) / 2);
+            cv::Mat next;
+            if (mode == PyramidMode::GAUSSIAN)
+                cv::pyrDown(prev, next, half);
+            else
+                cv::resize(prev, next, half, 0, 0, cv::INTER_AREA);
+            built.push_back(next);
+        }
+        return built.empty() ? base : built[std::min<size_t>(n, built.size()) - 1];
+    }
+
+    // the deepest level of an image of size whose sides are still at least min_size
+    static int level_for(cv::Size size, const cv::Size& min_size) {
+        int ret = 0;
+        while ((size.width + 1) / 2 >= min_size.width && (size.height + 1) / 2 >= min_size.height && size.width > 1 && size.height > 1) {
+            size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+            ++ret;
+        }
+        return ret;
+    }
+
+    // which level a level of size is of an image of base size
+    static int level_of(cv::Size base, const cv::Size& size) {
+        int ret = 0;
+        while ((base.width > size.width || base.height > size.height) && base.width > 1 && base.height > 1) {
+            base = cv::Size((base.width + 1) / 2, (base.height + 1) / 2);
+            ++ret;
+        }
+        return ret;
+    }
+
+    // forget the base and every level
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        base.release();
+        for (auto& l : levels) l.clear();
+    }
+};
@@ -0,0 +1,236 @@
+//
+// Region statistics and scanline polygon rasterisation
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+
+// a horizontal run of pixels [x0, x1) on row y
+struct ScanSpan {
+    int y;
+    int x0;
+    int x1;
+};
+
+// rasterise a polygon into row spans clipped to bounds, without any mask.
+// A pixel is inside when its centre is inside the polygon (even-odd rule),
+// so concave and self-intersecting polygons are handled too.
+static void polygon_spans(const std::vector<cv::Point>& points, const cv::Size& bounds, std::vector<ScanSpan>& spans) {
+    spans.clear();
+    const int n = points.size();
+    if (n < 3) return;
+
+    int y_min = INT_MAX, y_max = INT_MIN;
+    for (const cv::Point& p : points) {
+        y_min = std::min(y_min, p.y);
+        y_max = std::max(y_max, p.y);
+    }
+    y_min = std::max(y_min, 0);
+    y_max = std::min(y_max, bounds.height - 1);
+
+    std::vector<double> xs;
+    xs.reserve(n);
+    for (int y = y_min; y <= y_max; ++y) {
+        const double yc = y + 0.5;
+        xs.clear();
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            const cv::Point& a = points[i];
+            const cv::Point& b = points[j];
+            if ((a.y <= yc) != (b.y <= yc))
+                xs.push_back(a.x + (yc - a.y) * (b.x - a.x) / double(b.y - a.y));
+        }
+        std::sort(xs.begin(), xs.end());
+
+        for (size_t k = 0; k + 1 < xs.size(); k += 2) {
+            const int x0 = std::max(int(std::ceil(xs[k] - 0.5)), 0);
+            const int x1 = std::min(int(std::ceil(xs[k + 1] - 0.5)), bounds.width);
+            if (x0 < x1)
+                spans.push_back({y, x0, x1});
+        }
+    }
+}
+
+// bounding box of a set of spans, empty if there are none
+static cv::Rect spans_bounding_rect(const std::vector<ScanSpan>& spans) {
+    if (spans.empty()) return cv::Rect();
+
+    int x0 = INT_MAX, x1 = INT_MIN;
+    for (const ScanSpan& s : spans) {
+        x0 = std::min(x0, s.x0);
+        x1 = std::max(x1, s.x1);
+    }
+    return cv::Rect(x0, spans.front().y, x1 - x0, spans.back().y - spans.front().y + 1);
+}
+
+// copy the pixels under spans from src into dst, where dst pixel (x, y)
+// is read from src at (x - origin.x, y - origin.y)
+static void copy_spans(const cv::Mat& src, cv::Mat& dst, const std::vector<ScanSpan>& spans, const cv::Point& origin = cv::Point()) {
+    CV_Assert(src.type() == dst.type());
+    const size_t esz = dst.elemSize();
+    for (const ScanSpan& s : spans)
+        std::memcpy(dst.ptr(s.y) + s.x0 * esz, src.ptr(s.y - origin.y) + (s.x0 - origin.x) * esz, (s.x1 - s.x0) * esz);
+}
+
+struct RegionStats {
+    double area = 0;            // number of pixels in the region
+    cv::Point2d centroid;       // first moment divided by area
+    cv::Scalar mean_color;      // per channel mean over the region
+    double mu20 = 0;            // central second moments, as in cv::Moments
+    double mu11 = 0;
+    double mu02 = 0;
+
+    // orientation of the principal axis in radians
+    double orientation() const { return 0.5 * std::atan2(2 * mu11, mu20 - mu02); }
+};
+
+// Computes RegionStats for polygons and rectangles of one image.
+// Geometric moments are summed in closed form per span; colour sums come
+// either from the span pixels directly or, once built, from an integral image
+// so that each span costs O(1). The integral costs a full pass over the
+// frame, so it is only built when measuring many regions of the same image.
+class RegionAnalyzer {
+
+    cv::Mat img;
+    cv::Mat sums;   // (rows+1) x (cols+1) integral, CV_64F, same channels as img
+    std::vector<ScanSpan> spans;
+
+    // running raw moments and colour sums of the region being measured
+    struct Accum {
+        double m00 = 0, m10 = 0, m01 = 0, m20 = 0, m11 = 0, m02 = 0;
+        cv::Scalar color;
+    };
+
+    // sum of k^2 for k in [0, n)
+    static double sum_sq(const double n) { return (n - 1) * n * (2 * n - 1) / 6.0; }
+
+    // raw moments of the row span [x0, x1) on row y, in closed form
+    static void add_moments(Accum& acc, const int y, const int x0, const int x1) {
+        const double n = x1 - x0;
+        const double sx = (double(x0) + x1 - 1) * n / 2.0;
+        const double sxx = sum_sq(x1) - sum_sq(x0);
+
+        acc.m00 += n;
+        acc.m10 += sx;
+        acc.m01 += y * n;
+        acc.m20 += sxx;
+        acc.m11 += y * sx;
+        acc.m02 += double(y) * y * n;
+    }
+
+    // colour sum of rows [y0, y1) and columns [x0, x1) from the integral
+    void add_integral(Accum& acc, const int y0, const int y1, const int x0, const int x1) const {
+        const int cn = img.channels();
+        const double* top = sums.ptr<double>(y0);
+        const double* bot = sums.ptr<double>(y1);
+        for (int c = 0; c < cn; ++c)
+            acc.color[c] += bot[x1 * cn + c] - bot[x0 * cn + c] - top[x1 * cn + c] + top[x0 * cn + c];
+    }
+
+    void add_span(Accum& acc, const int y, const int x0, const int x1) const {
+        add_moments(acc, y, x0, x1);
+        if (sums.empty())
+            acc.color += cv::sum(img(cv::Range(y, y + 1), cv::Range(x0, x1)));
+        else
+            add_integral(acc, y, y + 1, x0, x1);
+    }
+
+    static RegionStats finish(const Accum& acc) {
+        RegionStats ret;
+        ret.area = acc.m00;
+        if (acc.m00 == 0) return ret;
+
+        const double cx = acc.m10 / acc.m00;
+        const double cy = acc.m01 / acc.m00;
+        ret.centroid = cv::Point2d(cx, cy);
+        ret.mean_color = acc.color * (1.0 / acc.m00);
+        ret.mu20 = acc.m20 - cx * acc.m10;
+        ret.mu11 = acc.m11 - cx * acc.m01;
+        ret.mu02 = acc.m02 - cy * acc.m01;
+        return ret;
+    }
+
+public:
+
+    RegionAnalyzer(const cv::Mat& _img) : img(_img) {
+        CV_Assert(img.channels() <= 4);
+    }
+
+    // build the integral image, O(frame) once so every later span is O(1)
+    void build_integral() {
+        if (sums.empty())
+            cv::integral(img, sums, CV_64F);
+    }
+
+    RegionStats stats(const std::vector<cv::Point>& polygon) {
+        polygon_spans(polygon, img.size(), spans);
+        Accum acc;
+        for (const ScanSpan& s : spans)
+            add_span(acc, s.y, s.x0, s.x1);
+        return finish(acc);
+    }
+
+    // rectangle statistics, O(rows of roi) for the moments; colour is one
+    // cv::sum over the roi, or O(1) when the integral is already built.
+    // Never builds the integral itself, that only pays off across many regions
+    RegionStats stats(const cv::Rect& roi) {
+        const cv::Rect r = roi & cv::Rect(0, 0, img.cols, img.rows);
+        Accum acc;
+        if (r.empty()) return finish(acc);
+
+        for (int y = r.y; y < r.y + r.height; ++y)
+            add_moments(acc, y, r.x, r.x + r.width);
+        if (sums.empty())
+            acc.color = cv::sum(img(r));
+        else
+            add_integral(acc, r.y, r.y + r.height, r.x, r.x + r.width);
+        return finish(acc);
+    }
+
+    std::vector<RegionStats> stats(const std::vector<std::vector<cv::Point>>& polygons) {
+        if (polygons.size() > 1) build_integral();
+
+        std::vector<RegionStats> ret;
+        ret.reserve(polygons.size());
+        for (const auto& polygon : polygons)
+            ret.push_back(stats(polygon));
+        return ret;
+    }
+
+    // pixel count of a polygon, no image data is touched
+    static int area(const std::vector<cv::Point>& polygon, const cv::Size& bounds) {
+        std::vector<ScanSpan> s;
+        polygon_spans(polygon, bounds, s);
+        int ret = 0;
+        for (const ScanSpan& span : s)
+            ret += span.x1 - span.x0;
+        return ret;
+    }
+
+    // centroid of the area enclosed by a simple polygon (shoelace formula),
+    // falls back to the vertex mean for degenerate polygons
+    static cv::Point2d polygon_centroid(const std::vector<cv::Point>& polygon) {
+        const int n = polygon.size();
+        double a = 0, cx = 0, cy = 0;
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            const double cross = double(polygon[j].x) * polygon[i].y - double(polygon[i].x) * polygon[j].y;
+            a += cross;
+            cx += (polygon[j].x + polygon[i].x) * cross;
+            cy += (polygon[j].y + polygon[i].y) * cross;
+        }
+
+        if (a == 0) {
+            cv::Point2d mean;
+            for (const cv::Point& p : polygon) mean += cv::Point2d(p);
+            return n ? mean * (1.0 / n) : mean;
+        }
+        return cv::Point2d(cx / (3 * a), cy / (3 * a));
+    }
+};
@@ -0,0 +1,116 @@
+//
+// Resizing with an interpolation policy and a cache of resized images
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <list>
+#include <mutex>
+
+
+enum class ResizePolicy {
+    AUTO,       // INTER_AREA shrinking, INTER_LINEAR enlarging
+    NEAREST,    // for masks and label images, never invents values
+    LINEAR,
+    AREA,
+    CUBIC
+};
+
+struct ResizeParams {
+    ResizePolicy policy = ResizePolicy::AUTO;
+    bool fast = false;      // trade quality for speed: area and cubic fall back to linear
+    bool cache = false;     // memoise the result in shared_resize_cache(); only for sources never written in place
+};
+
+// the cv::resize interpolation flag for a resize from src to dst
+static int resize_interpolation(const ResizeParams& params, const cv::Size& src, const cv::Size& dst) {
+    int ret = cv::INTER_LINEAR;
+    switch (params.policy) {
+        case ResizePolicy::AUTO:
+            ret = dst.area() < src.area() ? cv::INTER_AREA : cv::INTER_LINEAR;
+            break;
+        case ResizePolicy::NEAREST: return cv::INTER_NEAREST;
+        case ResizePolicy::LINEAR: ret = cv::INTER_LINEAR; break;
+        case ResizePolicy::AREA: ret = cv::INTER_AREA; break;
+        case ResizePolicy::CUBIC: ret = cv::INTER_CUBIC; break;
+    }
+    return params.fast ? cv::INTER_LINEAR : ret;
+}
+
+// Small least-recently-used cache of resize results keyed by source buffer,
+// target size and interpolation. Entries hold a reference to their source,
+// so a key's buffer cannot be freed and reused by another image while it is
+// cached. The key is the buffer's identity, not its contents, so a source
+// rewritten in place (a reused capture frame, a Mat written through
+// Image::mutable_mat()) would hit its old result; that is why the cache is
+// opt-in per call. Results are shared and must not be written either.
+class ResizeCache {
+
+    struct Entry {
+        cv::Mat src;
+        cv::Size size;
+        int interpolation;
+        cv::Mat result;
+    };
+
+    size_t capacity;
+    std::list<Entry> entries;   // most recently used first
+    std::mutex mutex;
+
+    static bool same_source(const cv::Mat& a, const cv::Mat& b) {
+        return a.data == b.data && a.size() == b.size() && a.type() == b.type() && a.step == b.step;
+    }
+
+public:
+
+    ResizeCache(const size_t _capacity = 8) : capacity(_capacity) {}
+
+    cv::Mat get(const cv::Mat& src, const cv::Size& size, const int interpolation) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->size == size && it->interpolation == interpolation && same_source(it->src, src)) {
+                    entries.splice(entries.begin(), entries, it);
+                    return it->result;
+                }
+            }
+        }
+
+        cv::Mat result;
+        cv::resize(src, result, size, 0, 0, interpolation);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.push_front(Entry{src, size, interpolation, result});
+        while (entries.size() > capacity) entries.pop_back();
+        return result;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+};
+
+// process-wide cache used by Image::fit_to_size and Image::resize
+inline ResizeCache& shared_resize_cache() {
+    static ResizeCache cache;
+    return cache;
+}
+
+// src resized to size under params, dst may share the cached buffer
+static void resize_image(const cv::Mat& src, cv::Mat& dst, const cv::Size& size, const ResizeParams& params = ResizeParams()) {
+    if (src.size() == size) {
+        dst = src;
+        return;
+    }
+    const int interpolation = resize_interpolation(params, src.size(), size);
+    if (params.cache) {
+        dst = shared_resize_cache().get(src, size, interpolation);
+        return;
+    }
+    cv::Mat result;
+    cv::resize(src, result, size, 0, 0, interpolation);
+    dst = result;
+}
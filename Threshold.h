@@ -0,0 +1,334 @@
+//
+// Threshold engine and associated functions
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <array>
+#include <climits>
+#include <mutex>
+#include <cassert>
+
+#include "Executor.h"
+
+
+// how the threshold value is chosen
+enum class ThresholdMode {
+    FIXED,              // use ThresholdParams::value as is
+    OTSU,               // maximise between-class variance of the histogram
+    TRIANGLE,           // triangle method on the histogram
+    ADAPTIVE_MEAN,      // per pixel, mean of a block_size window minus c
+    ADAPTIVE_GAUSSIAN,  // per pixel, gaussian weighted window minus c
+};
+
+struct ThresholdParams {
+    ThresholdMode mode = ThresholdMode::FIXED;
+    int type = cv::THRESH_BINARY;   // one of cv::THRESH_BINARY .. cv::THRESH_TOZERO_INV
+    int value = 127;                // threshold for FIXED mode
+    int max_value = 255;
+    int block_size = 11;            // window side for the adaptive modes, odd
+    double c = 2.0;                 // constant subtracted from the adaptive window mean
+};
+
+// Thresholds 8-bit BGR or gray frames.
+// Keeps its working buffers so that repeated calls on frames of the same size
+// (e.g. every frame of a video) do not allocate.
+class ThresholdEngine {
+
+    ThresholdParams params;
+
+    cv::Mat gray;       // view of the current gray frame
+    cv::Mat gray_buf;   // owned storage for converted frames, never aliases the caller's
+    cv::Mat sums;
+    std::array<int, 256> hist{};
+    cv::Mat lut = cv::Mat(1, 256, CV_8UC1);
+    int lut_thresh = -1;
+    int last_thresh = -1;
+
+    // fixed-point BGR to gray weights, same as cv::cvtColor
+    static constexpr int GRAY_SHIFT = 14;
+    static constexpr int B_WEIGHT = 1868;
+    static constexpr int G_WEIGHT = 9617;
+    static constexpr int R_WEIGHT = 4899;
+
+    static inline uchar bgr_to_gray(const uchar* p) {
+        return uchar((p[0] * B_WEIGHT + p[1] * G_WEIGHT + p[2] * R_WEIGHT + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+    }
+
+public:
+
+    ThresholdEngine(const ThresholdParams& _params = ThresholdParams()) : params(_params) {
+        assert(params.type >= cv::THRESH_BINARY && params.type <= cv::THRESH_TOZERO_INV);
+        assert(params.value >= 0 && params.value < 256);
+        assert(params.max_value >= 0 && params.max_value < 256);
+        if (params.mode == ThresholdMode::ADAPTIVE_MEAN || params.mode == ThresholdMode::ADAPTIVE_GAUSSIAN) {
+            assert(params.block_size % 2 == 1 && params.block_size > 1);
+            assert(params.type == cv::THRESH_BINARY || params.type == cv::THRESH_BINARY_INV);
+        }
+    }
+
+    // copies share no buffers (cv::Mat copies are shallow), so each copy
+    // can run on its own thread
+    ThresholdEngine(const ThresholdEngine& other) : ThresholdEngine(other.params) {}
+    ThresholdEngine& operator=(const ThresholdEngine& other) {
+        if (this != &other) {
+            params = other.params;
+            gray = cv::Mat();
+            gray_buf = cv::Mat();
+            sums = cv::Mat();
+            lut = cv::Mat(1, 256, CV_8UC1);
+            lut_thresh = -1;
+            last_thresh = -1;
+        }
+        return *this;
+    }
+
+    const ThresholdParams& get_params() const { return params; }
+
+    // threshold chosen for the last frame, -1 for the adaptive modes
+    int last_threshold() const { return last_thresh; }
+
+    // threshold src (8-bit, 1 or 3 channels) into a single channel dst, dst must not be src
+    void apply(const cv::Mat& src, cv::Mat& dst) {
+        CV_Assert(src.type() == CV_8UC3 || src.type() == CV_8UC1);
+
+        switch (params.mode) {
+        case ThresholdMode::FIXED:
+            // threshold is known up front, so conversion and mapping are fused
+            set_lut(params.value);
+            gray_with_lut(src, dst);
+            last_thresh = params.value;
+            break;
+        case ThresholdMode::OTSU:
+        case ThresholdMode::TRIANGLE:
+            gray_with_histogram(src);
+            last_thresh = params.mode == ThresholdMode::OTSU ? otsu_threshold(hist) : triangle_threshold(hist);
+            set_lut(last_thresh);
+            cv::LUT(gray, lut, dst);
+            break;
+        case ThresholdMode::ADAPTIVE_MEAN:
+            to_gray(src);
+            adaptive_mean(dst);
+            last_thresh = -1;
+            break;
+        case ThresholdMode::ADAPTIVE_GAUSSIAN:
+            to_gray(src);
+            adaptive_gaussian(dst);
+            last_thresh = -1;
+            break;
+        }
+    }
+
+    // Otsu's threshold from a 256 bin histogram
+    static int otsu_threshold(const std::array<int, 256>& h) {
+        double total = 0, sum = 0;
+        for (int i = 0; i < 256; ++i) {
+            total += h[i];
+            sum += double(i) * h[i];
+        }
+
+        double sum_b = 0, w_b = 0, best_var = 0;
+        int best = 0;
+        for (int t = 0; t < 256; ++t) {
+            w_b += h[t];
+            if (w_b == 0) continue;
+            const double w_f = total - w_b;
+            if (w_f == 0) break;
+
+            sum_b += double(t) * h[t];
+            const double m_b = sum_b / w_b;
+            const double m_f = (sum - sum_b) / w_f;
+            const double between = w_b * w_f * (m_b - m_f) * (m_b - m_f);
+            if (between > best_var) {
+                best_var = between;
+                best = t;
+            }
+        }
+        return best;
+    }
+
+    // triangle threshold from a 256 bin histogram, as in cv::THRESH_TRIANGLE
+    static int triangle_threshold(std::array<int, 256> h) {
+        int left = 0, right = 0, peak = 0, peak_val = 0;
+
+        for (int i = 0; i < 256; ++i)
+            if (h[i] > 0) { left = i; break; }
+        if (left > 0) --left;
+
+        for (int i = 255; i > 0; --i)
+            if (h[i] > 0) { right = i; break; }
+        if (right < 255) ++right;
+
+        for (int i = 0; i < 256; ++i)
+            if (h[i] > peak_val) { peak_val = h[i]; peak = i; }
+
+        // always measure along the longer tail
+        bool flip = false;
+        if (peak - left < right - peak) {
+            flip = true;
+            for (int i = 0, j = 255; i < j; ++i, --j)
+                std::swap(h[i], h[j]);
+            left = 255 - right;
+            peak = 255 - peak;
+        }
+
+        int thresh = left;
+        const double a = peak_val;
+        const double b = left - peak;
+        double dist = 0;
+        for (int i = left + 1; i <= peak; ++i) {
+            const double d = a * i + b * h[i];
+            if (d > dist) {
+                dist = d;
+                thresh = i;
+            }
+        }
+        --thresh;
+
+        return flip ? 255 - thresh : thresh;
+    }
+
+private:
+
+    // rebuild the 256 entry mapping for threshold t, if it changed
+    void set_lut(const int t) {
+        if (t == lut_thresh) return;
+
+        const uchar max_val = uchar(params.max_value);
+        uchar* l = lut.ptr<uchar>();
+        for (int v = 0; v < 256; ++v) {
+            const bool above = v > t;
+            switch (params.type) {
+            case cv::THRESH_BINARY:     l[v] = above ? max_val : 0; break;
+            case cv::THRESH_BINARY_INV: l[v] = above ? 0 : max_val; break;
+            case cv::THRESH_TRUNC:      l[v] = above ? uchar(t) : uchar(v); break;
+            case cv::THRESH_TOZERO:     l[v] = above ? uchar(v) : 0; break;
+            case cv::THRESH_TOZERO_INV: l[v] = above ? 0 : uchar(v); break;
+            }
+        }
+        lut_thresh = t;
+    }
+
+    void to_gray(const cv::Mat& src) {
+        if (src.channels() == 1) {
+            gray = src;
+            return;
+        }
+        gray_buf.create(src.size(), CV_8UC1);
+        gray = gray_buf;
+        shared_executor().parallel_for(cv::Range(0, src.rows), [&](const cv::Range& range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const uchar* s = src.ptr<uchar>(y);
+                uchar* g = gray.ptr<uchar>(y);
+                for (int x = 0; x < src.cols; ++x, s += 3)
+                    g[x] = bgr_to_gray(s);
+            }
+        });
+    }
+
+    // one pass: gray conversion and the 256 bin histogram of the result
+    void gray_with_histogram(const cv::Mat& src) {
+        if (src.channels() == 1) {
+            gray = src;
+        } else {
+            gray_buf.create(src.size(), CV_8UC1);
+            gray = gray_buf;
+        }
+        hist.fill(0);
+
+        std::mutex hist_mutex;
+        shared_executor().parallel_for(cv::Range(0, src.rows), [&](const cv::Range& range) {
+            std::array<int, 256> local{};
+            for (int y = range.start; y < range.end; ++y) {
+                const uchar* s = src.ptr<uchar>(y);
+                if (src.channels() == 3) {
+                    uchar* g = gray.ptr<uchar>(y);
+                    for (int x = 0; x < src.cols; ++x, s += 3) {
+                        const uchar v = bgr_to_gray(s);
+                        g[x] = v;
+                        ++local[v];
+                    }
+                } else {
+                    for (int x = 0; x < src.cols; ++x)
+                        ++local[s[x]];
+                }
+            }
+            std::lock_guard<std::mutex> lock(hist_mutex);
+            for (int i = 0; i < 256; ++i)
+                hist[i] += local[i];
+        });
+    }
+
+    // one pass: gray conversion followed directly by the lookup
+    void gray_with_lut(const cv::Mat& src, cv::Mat& dst) {
+        if (src.channels() == 1) {
+            cv::LUT(src, lut, dst);
+            return;
+        }
+        dst.create(src.size(), CV_8UC1);
+        const uchar* l = lut.ptr<uchar>();
+        shared_executor().parallel_for(cv::Range(0, src.rows), [&](const cv::Range& range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const uchar* s = src.ptr<uchar>(y);
+                uchar* d = dst.ptr<uchar>(y);
+                for (int x = 0; x < src.cols; ++x, s += 3)
+                    d[x] = l[bgr_to_gray(s)];
+            }
+        });
+    }
+
+    // O(1) per pixel window mean from the integral image
+    template <typename Sum_T>
+    void adaptive_mean_pass(cv::Mat& dst) const {
+        const int r = params.block_size / 2;
+        const uchar on = params.type == cv::THRESH_BINARY ? uchar(params.max_value) : 0;
+        const uchar off = params.type == cv::THRESH_BINARY ? 0 : uchar(params.max_value);
+
+        shared_executor().parallel_for(cv::Range(0, gray.rows), [&](const cv::Range& range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const int y0 = std::max(y - r, 0), y1 = std::min(y + r + 1, gray.rows);
+                const Sum_T* top = sums.ptr<Sum_T>(y0);
+                const Sum_T* bot = sums.ptr<Sum_T>(y1);
+                const uchar* g = gray.ptr<uchar>(y);
+                uchar* d = dst.ptr<uchar>(y);
+                for (int x = 0; x < gray.cols; ++x) {
+                    const int x0 = std::max(x - r, 0), x1 = std::min(x + r + 1, gray.cols);
+                    const double area = double(y1 - y0) * (x1 - x0);
+                    const double sum = double(bot[x1] - bot[x0] - top[x1] + top[x0]);
+                    d[x] = g[x] > sum / area - params.c ? on : off;
+                }
+            }
+        });
+    }
+
+    void adaptive_mean(cv::Mat& dst) {
+        dst.create(gray.size(), CV_8UC1);
+        // 32-bit sums are exact as long as the whole frame fits
+        const bool fits_int = double(gray.total()) * 255.0 < double(INT_MAX);
+        cv::integral(gray, sums, fits_int ? CV_32S : CV_64F);
+        if (fits_int)
+            adaptive_mean_pass<int>(dst);
+        else
+            adaptive_mean_pass<double>(dst);
+    }
+
+    void adaptive_gaussian(cv::Mat& dst) {
+        cv::Mat mean;
+        cv::GaussianBlur(gray, mean, cv::Size(params.block_size, params.block_size), 0, 0, cv::BORDER_REPLICATE);
+
+        dst.create(gray.size(), CV_8UC1);
+        const uchar on = params.type == cv::THRESH_BINARY ? uchar(params.max_value) : 0;
+        const uchar off = params.type == cv::THRESH_BINARY ? 0 : uchar(params.max_value);
+        shared_executor().parallel_for(cv::Range(0, gray.rows), [&](const cv::Range& range) {
+            for (int y = range.start; y < range.end; ++y) {
+                const uchar* g = gray.ptr<uchar>(y);
+                const uchar* m = mean.ptr<uchar>(y);
+                uchar* d = dst.ptr<uchar>(y);
+                for (int x = 0; x < gray.cols; ++x)
+                    d[x] = g[x] > m[x] - params.c ? on : off;
+            }
+        });
+    }
+};
@@ -0,0 +1,158 @@
+//
+// Change detection on tiles and filters recomputed only where frames change
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <algorithm>
+
+#include "FrameFilter.h"
+
+
+struct TileParams {
+    int tile = 64;                  // tile side in full resolution pixels
+    int halo = 8;                   // least context around each recomputed tile, raised to the filter's reach
+    int scale = 4;                  // change detection runs at 1/scale resolution
+    double diff_threshold = 10;     // mean absolute gray difference that marks a tile dirty
+    double full_frame_ratio = 0.5;  // above this share of dirty tiles, filter the whole frame
+};
+
+// Marks the tiles of a frame whose content differs from what was last seen
+// there, comparing block means of a downscaled gray copy. A tile's
+// reference is only refreshed when it is marked dirty, so slow drifts still
+// add up to a change eventually.
+class DirtyTiles {
+
+    TileParams params;
+    cv::Mat reference;  // downscaled gray, per tile as of its last refresh
+    cv::Mat small, small_gray, diff;
+    std::vector<uchar> dirty;
+    int tiles_x = 0;
+    int tiles_y = 0;
+    int n_dirty = 0;
+
+public:
+
+    DirtyTiles(const TileParams& _params = TileParams()) : params(_params) {
+        CV_Assert(params.tile % params.scale == 0);
+    }
+
+    int cols() const { return tiles_x; }
+    int rows() const { return tiles_y; }
+    int count() const { return n_dirty; }
+    bool is_dirty(const int tx, const int ty) const { return dirty[ty * tiles_x + tx]; }
+    double dirty_ratio() const { return dirty.empty() ? 1.0 : double(n_dirty) / dirty.size(); }
+
+    // full resolution rectangle of a tile, clipped to frame_size
+    cv::Rect tile_rect(const int tx, const int ty, const cv::Size& frame_size) const {
+        return cv::Rect(tx * params.tile, ty * params.tile, params.tile, params.tile) & cv::Rect(cv::Point(), frame_size);
+    }
+
+    // compare frame against the references and mark changed tiles
+    void update(const cv::Mat& frame) {
+        const cv::Size small_size(
+            (frame.cols + params.scale - 1) / params.scale,
+            (frame.rows + params.scale - 1) / params.scale);
+        cv::resize(frame, small, small_size, 0, 0, cv::INTER_AREA);
+        if (small.channels() == 3)
+            cv::cvtColor(small, small_gray, cv::COLOR_BGR2GRAY);
+        else
+            small_gray = small;
+
+        const int block = params.tile / params.scale;
+        tiles_x = (small_size.width + block - 1) / block;
+        tiles_y = (small_size.height + block - 1) / block;
+
+        // first frame or a size change, everything is new
+        if (reference.size() != small_gray.size()) {
+            reference = small_gray.clone();
+            dirty.assign(tiles_x * tiles_y, 1);
+            n_dirty = dirty.size();
+            return;
+        }
+
+        cv::absdiff(small_gray, reference, diff);
+        n_dirty = 0;
+        for (int ty = 0; ty < tiles_y; ++ty) {
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                const cv::Rect r = cv::Rect(tx * block, ty * block, block, block) & cv::Rect(cv::Point(), small_size);
+                const bool changed = cv::mean(diff(r))[0] > params.diff_threshold;
+                dirty[ty * tiles_x + tx] = changed;
+                if (changed) {
+                    small_gray(r).copyTo(reference(r));
+                    ++n_dirty;
+                }
+            }
+        }
+    }
+};
+
+// Wraps a FrameFilter so that only dirty tiles are filtered again; the rest
+// of the output is kept from earlier frames. reach is how far, in pixels,
+// an input pixel affects the output (kernel_sz / 2 for a blur): output is
+// refreshed that far around each dirty run, from input with a halo of at
+// least that much more, so such filters match the untiled output exactly.
+// Filters with unbounded reach (e.g. Canny's hysteresis) pass 0 and can
+// differ slightly along tile borders.
+class TiledFilter {
+
+    FrameFilter filter;
+    TileParams params;
+    DirtyTiles tiles;
+    int reach;
+    cv::Mat out;        // persistent output, patched tile by tile
+    cv::Mat patch;
+
+public:
+
+    TiledFilter(const FrameFilter& _filter, const TileParams& _params = TileParams(), const int _reach = 0)
+        : filter(_filter), params(_params), tiles(_params), reach(std::max(0, _reach)) {
+        params.halo = std::max(params.halo, reach);
+    }
+
+    // dst gets a copy of the output, so callers may keep it across calls
+    // like the output of any other FrameFilter
+    void apply(const cv::Mat& frame, cv::Mat& dst) {
+        tiles.update(frame);
+
+        if (out.empty() || tiles.dirty_ratio() > params.full_frame_ratio) {
+            filter(frame, out);
+            dst = out.clone();
+            return;
+        }
+
+        const cv::Rect bounds(cv::Point(), frame.size());
+        for (int ty = 0; ty < tiles.rows(); ++ty) {
+            for (int tx = 0; tx < tiles.cols(); ++tx) {
+                if (!tiles.is_dirty(tx, ty)) continue;
+
+                // merge the run of dirty tiles on this row into one call
+                int end = tx;
+                while (end + 1 < tiles.cols() && tiles.is_dirty(end + 1, ty)) ++end;
+                const cv::Rect run = tiles.tile_rect(tx, ty, frame.size()) | tiles.tile_rect(end, ty, frame.size());
+                tx = end;
+
+                const cv::Rect r = cv::Rect(run.x - reach, run.y - reach,
+                                            run.width + 2 * reach, run.height + 2 * reach) & bounds;
+                const cv::Rect padded = cv::Rect(r.x - params.halo, r.y - params.halo,
+                                                 r.width + 2 * params.halo, r.height + 2 * params.halo) & bounds;
+                filter(frame(padded), patch);
+                patch(r - padded.tl()).copyTo(out(r));
+            }
+        }
+        dst = out.clone();
+    }
+};
+
+// a FrameFilter that only recomputes the parts of the frame that changed;
+// filter itself when its reach is comparable to a tile, since every tile
+// would then be recomputed with several times its area of context
+static FrameFilter tiled_filter(const FrameFilter& filter, const TileParams& params = TileParams(), const int reach = 0) {
+    if (2 * reach >= params.tile) return filter;
+    return [tiled = TiledFilter(filter, params, reach)](const cv::Mat& in, cv::Mat& out) mutable {
+        tiled.apply(in, out);
+    };
+}
@@ -0,0 +1,183 @@
+//
+// Scoped timing spans written out as Chrome trace JSON
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Allocator.h"
+
+
+// Spans are compiled in only when IMGUTIL_TRACE is defined; otherwise
+// IMGUTIL_TRACE_SPAN expands to nothing and costs nothing. When compiled
+// in, an idle span costs two atomic loads: whether tracing was started and
+// whether the counting allocator is installed.
+#define IMGUTIL_TRACE_CONCAT_(a, b) a##b
+#define IMGUTIL_TRACE_CONCAT(a, b) IMGUTIL_TRACE_CONCAT_(a, b)
+#ifdef IMGUTIL_TRACE
+#define IMGUTIL_TRACE_SPAN(name) TraceSpan IMGUTIL_TRACE_CONCAT(trace_span_, __LINE__)(name)
+#else
+#define IMGUTIL_TRACE_SPAN(name) ((void)0)
+#endif
+
+struct TraceEvent {
+    const char* name;   // a string literal, never freed
+    double start_us;    // since tracing started
+    double duration_us;
+    int thread;
+    AllocationStats allocated;  // counted when the counting allocator is installed
+};
+
+// Collects finished spans into one buffer per thread, so recording never
+// contends with other threads, and merges them when tracing stops.
+class Tracer {
+
+    using Clock = std::chrono::steady_clock;
+
+    struct ThreadBuffer {
+        std::mutex mutex;       // only contended while stop() drains it
+        std::vector<TraceEvent> events;
+        int thread;
+
+        ThreadBuffer() : thread(Tracer::instance().attach(this)) {}
+        ~ThreadBuffer() { Tracer::instance().detach(this); }
+    };
+
+    std::atomic<bool> enabled{false};
+    // start of the trace in clock ticks, atomic since spans still running
+    // on other threads read it while start() moves it
+    std::atomic<Clock::rep> origin{Clock::now().time_since_epoch().count()};
+    std::mutex mutex;
+    std::vector<ThreadBuffer*> threads;
+    std::vector<TraceEvent> finished;   // from threads that have exited
+    int next_thread = 0;
+
+    int attach(ThreadBuffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.push_back(buffer);
+        return next_thread++;
+    }
+
+    void detach(ThreadBuffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            finished.insert(finished.end(), buffer->events.begin(), buffer->events.end());
+        }
+        threads.erase(std::remove(threads.begin(), threads.end(), buffer), threads.end());
+    }
+
+    static ThreadBuffer& local_buffer() {
+        thread_local ThreadBuffer buffer;
+        return buffer;
+    }
+
+    static std::string escape(const char* s) {
+        std::string ret;
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\') ret += '\\';
+            ret += *s;
+        }
+        return ret;
+    }
+
+public:
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool active() const { return enabled.load(std::memory_order_acquire); }
+
+    // drop anything recorded so far and start recording, times relative to now
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.clear();
+        for (ThreadBuffer* buffer : threads) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            buffer->events.clear();
+        }
+        origin.store(Clock::now().time_since_epoch().count(), std::memory_order_release);
+        enabled.store(true, std::memory_order_release);
+    }
+
+    void record(const char* name, const Clock::time_point& begin, const Clock::time_point& end, const AllocationStats& allocated = AllocationStats()) {
+        ThreadBuffer& buffer = local_buffer();
+        const Clock::time_point start(Clock::duration(origin.load(std::memory_order_acquire)));
+        const double start_us = std::chrono::duration<double, std::micro>(begin - start).count();
+        const double duration_us = std::chrono::duration<double, std::micro>(end - begin).count();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        buffer.events.push_back({name, start_us, duration_us, buffer.thread, allocated});
+    }
+
+    // stop recording and return every span, from all threads
+    std::vector<TraceEvent> stop() {
+        enabled.store(false, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<TraceEvent> ret = finished;
+        for (ThreadBuffer* buffer : threads) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            ret.insert(ret.end(), buffer->events.begin(), buffer->events.end());
+        }
+        return ret;
+    }
+
+    // stop recording and write the spans as Chrome trace JSON, which
+    // chrome://tracing and ui.perfetto.dev open; false if filename failed
+    bool stop(const std::string& filename) {
+        const std::vector<TraceEvent> events = stop();
+        std::ofstream out(filename);
+        if (!out) return false;
+
+        out << std::fixed;
+        out.precision(3);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (size_t i = 0; i < events.size(); ++i) {
+            const TraceEvent& e = events[i];
+            out << (i ? ",\n" : "\n")
+                << "{\"name\":\"" << escape(e.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+                << ",\"args\":{\"allocations\":" << e.allocated.allocations
+                << ",\"bytes\":" << e.allocated.bytes
+                << ",\"peak_live_bytes\":" << e.allocated.peak_live_bytes << "}}";
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+};
+
+// times its own scope, see IMGUTIL_TRACE_SPAN; with the counting allocator
+// installed it is also an AllocationScope of the same name
+class TraceSpan {
+
+    const char* name;
+    std::chrono::steady_clock::time_point begin;
+    bool recording;
+    AllocationScope allocations;
+
+public:
+
+    explicit TraceSpan(const char* _name) : name(_name), recording(Tracer::instance().active()), allocations(_name) {
+        if (recording) begin = std::chrono::steady_clock::now();
+    }
+
+    ~TraceSpan() {
+        if (recording) Tracer::instance().record(name, begin, std::chrono::steady_clock::now(), allocations.so_far());
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+inline void start_tracing() { Tracer::instance().start(); }
+
+// write everything traced since start_tracing to filename
+inline bool stop_tracing(const std::string& filename) { return Tracer::instance().stop(filename); }
@@ -7,13 +7,121 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/tracking.hpp>
 
+#include "Threshold.h"
+#include "Warp.h"
+#include "FrameFilter.h"
+#include "FrameReader.h"
+#include "TileCache.h"
+#include "MotionGate.h"
+#include "Detector.h"
+#include "Compositor.h"
+#include "Trace.h"
+#include "Executor.h"
+
 #include <string>
 #include <vector>
 #include <iostream>
 #include <cassert>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <exception>
+#include <cstdio>
+#include <memory>
+#include <algorithm>
+#include <optional>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+
+// capture-to-output latency of a live run, in milliseconds
+struct LatencyStats {
+    int processed = 0;          // frames that made it to the output
+    int stale = 0;              // frames skipped for being older than the budget
+    size_t dropped = 0;         // frames overwritten or skipped in the read-ahead ring
+    double mean_ms = 0;
+    double p50_ms = 0;
+    double p95_ms = 0;
+    double max_ms = 0;
+};
+
+static std::ostream& operator<<(std::ostream& os, const LatencyStats& stats) {
+    return os << "processed " << stats.processed
+              << ", stale " << stats.stale
+              << ", dropped " << stats.dropped
+              << ", latency ms (mean/p50/p95/max) "
+              << stats.mean_ms << "/" << stats.p50_ms << "/" << stats.p95_ms << "/" << stats.max_ms;
+}
+
+// Encodes frames that arrive out of order, from several segment workers, in
+// frame order into one file. Frames ahead of the next one to write wait in a
+// reorder buffer of up to capacity frames; a worker delivering the next
+// frame is never held up, so the buffer cannot deadlock as long as every
+// index is eventually delivered, an empty Mat marking a frame to skip.
+class OrderedWriter {
+
+    std::string filename;
+    double fps;
+    size_t capacity;
+    cv::VideoWriter output;
+
+    std::mutex mutex;
+    std::condition_variable room;
+    std::map<int, cv::Mat> pending;
+    int next = 0;
+    bool writing = false;   // one thread encodes at a time, outside the lock
+    std::exception_ptr error;   // first encoder failure, rethrown by release
+
+public:
+
+    OrderedWriter(const std::string& _filename, const double _fps, const size_t _capacity)
+        : filename(_filename), fps(_fps), capacity(std::max<size_t>(1, _capacity)) {}
+
+    // hand over frame index, exactly once; whoever delivers the next frame
+    // writes it and every buffered frame that follows it. Never throws, so
+    // workers can always keep the sequence complete
+    void put(const int index, cv::Mat frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        room.wait(lock, [&] { return index == next || pending.size() < capacity; });
+        pending.emplace(index, std::move(frame));
+        if (writing) return;
+        writing = true;
+        for (auto it = pending.find(next); it != pending.end(); it = pending.find(next)) {
+            cv::Mat f = std::move(it->second);
+            pending.erase(it);
+            ++next;
+            lock.unlock();
+            room.notify_all();
+            if (!f.empty() && !error) {
+                try {
+                    if (!output.isOpened())
+                        output.open(filename, cv::VideoWriter::fourcc('M','J','P','G'), fps, f.size(), f.channels() == 3);
+                    IMGUTIL_TRACE_SPAN("write");
+                    output.write(f);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            lock.lock();
+        }
+        writing = false;
+    }
 
+    // frames written so far, skipped ones included
+    int written() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next;
+    }
 
+    // close the file, rethrowing an encoder failure
+    void release() {
+        output.release();
+        if (error) std::rethrow_exception(error);
+    }
+};
 
 class Video {
 
@@ -21,25 +129,81 @@ class Video {
     cv::VideoCapture capture;
     int cap_width = capture.get(cv::CAP_PROP_FRAME_WIDTH);
     int cap_height = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+    // file this video was opened from, empty for cameras and streams
+    std::string source;
+    // decodes ahead of processing once read_ahead is called, shared by copies
+    std::shared_ptr<FrameReader> reader;
+
+    // next frame, from the read-ahead ring when one is running
+    bool next_frame(cv::Mat& frame) {
+        IMGUTIL_TRACE_SPAN("read");
+        return reader ? reader->read(frame) : capture.read(frame);
+    }
+
+    // encode a frame to output
+    static void write_frame(cv::VideoWriter& output, const cv::Mat& frame) {
+        IMGUTIL_TRACE_SPAN("write");
+        output.write(frame);
+    }
+
+    void release_capture() {
+        if (reader) reader->stop();
+        reader.reset();
+        capture.release();
+    }
+
+    // when set, edge_detect, gaussian_blur and detection skip unchanged tiles
+    std::optional<TileParams> tiling;
+
+    // when set, detection only runs where background subtraction sees motion
+    std::optional<MotionParams> motion_gating;
+
+    // reach as for tiled_filter, how far a pixel affects the filter's output
+    FrameFilter with_tiling(const FrameFilter& filter, const int reach = 0) const {
+        return tiling ? tiled_filter(filter, *tiling, reach) : filter;
+    }
 
 public:
 
     Video() = default;
     // construct an image from a filename
-    Video(const std::string& filename) : capture(cv::VideoCapture(filename)) {
+    Video(const std::string& filename) : capture(cv::VideoCapture(filename)), source(filename) {
         if (!capture.isOpened()) throw FailedToLoadImgErr{};
     }
     // construct an image from a cv::Mat (cv's image class)
     Video(const cv::VideoCapture cap) : capture(cap) {}
+    // open a camera by index
+    Video(const int camera_index) : capture(cv::VideoCapture(camera_index)) {
+        if (!capture.isOpened()) throw FailedToLoadImgErr{};
+    }
+
+    // decode up to depth frames ahead on a background thread; use
+    // ReaderPolicy::DROP_OLDEST for live sources so a slow filter never
+    // stalls the capture, and pace_fps to replay a file at real time
+    void read_ahead(const size_t depth = 4, const ReaderPolicy policy = ReaderPolicy::BLOCK, const double pace_fps = 0) {
+        if (reader) reader->stop();
+        reader = std::make_shared<FrameReader>(capture, depth, policy, pace_fps);
+    }
+
+    // recompute filters only in tiles that changed since the last frame, for
+    // fixed cameras where most of the scene is static
+    void skip_static(const TileParams& params = TileParams()) { tiling = params; }
+    void process_all() { tiling.reset(); motion_gating.reset(); }
+
+    // run detection only on regions that move, and not at all on still frames
+    void gate_on_motion(const MotionParams& params = MotionParams()) { motion_gating = params; }
+
+    // frames the read-ahead ring dropped because processing fell behind
+    size_t dropped_frames() const { return reader ? reader->dropped_frames() : 0; }
 
     // display this image, optionally wait for a keystroke to move on
     void show(const std::string& filename = "Video")  {
         cv::Mat frame;
         std::cout << "* Press ESC on the Video Window to exit\n";
-        while (capture.read(frame)){
+        while (next_frame(frame)){
             cv::imshow(filename, frame);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 std::cout << "finished by user\n";
                 break;
             }
@@ -48,30 +212,32 @@ public:
     
 //implement save     
     Video saveAs(const std::string& filename="save.avi"){
+        IMGUTIL_TRACE_SPAN("Video::saveAs");
         std::cout << "Saving Video..." << std::endl;
         cv::VideoWriter output(filename, cv::VideoWriter::fourcc('M','J','P','G'), 0, cv::Size(cap_width,cap_height));
         cv::Mat frame;
-        while(capture.read(frame)){
-            output.write(frame);
+        while(next_frame(frame)){
+            write_frame(output, frame);
         }
         output.release();
         return Video(filename);
     }
 
     Video grayscale(){
+        IMGUTIL_TRACE_SPAN("Video::grayscale");
         cv::VideoWriter output("videos/grayscale.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
         cv::Mat frame;
         std::cout << "Saving Grayscale Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
             cv::Mat ret;
             cv::cvtColor(frame, ret, cv::COLOR_BGR2GRAY);
             cv::imshow("Grayscale", ret);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(ret);
+            write_frame(output, ret);
         }
         output.release();
         return Video("videos/grayscale.avi"); 
@@ -80,42 +246,46 @@ public:
 
 
     Video edge_detect(const int lower_threshold, const int upper_threshold)  {
+        IMGUTIL_TRACE_SPAN("Video::edge_detect");
         cv::VideoWriter output("videos/edge_detection_video.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
         cv::Mat frame;
+        FrameFilter filter = with_tiling(edge_detect_filter(lower_threshold, upper_threshold));
         std::cout << "Saving Edge Detection Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
             cv::Mat ret;
-            cv::Canny(frame, ret, lower_threshold, upper_threshold);
+            filter(frame, ret);
             cv::imshow("Edge Detection", ret);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(ret);
+            write_frame(output, ret);
         }
         output.release();
         return Video("videos/edge_detection_video.avi"); 
     }
 
     Video gaussian_blur(const int kernel_sz)  {
+        IMGUTIL_TRACE_SPAN("Video::gaussian_blur");
         debug_assert(kernel_sz % 2, "Kernel size must be an odd number");
         debug_assert(kernel_sz > 1, "Kernel size must be greater than 1");
         debug_assert(kernel_sz < 1000, "Kernel size must be less than 1000");
 
         cv::VideoWriter output("videos/gaussian_blur.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
         cv::Mat frame;
+        FrameFilter filter = with_tiling(gaussian_blur_filter(kernel_sz), kernel_sz / 2);
         std::cout << "Saving Blurred Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
             cv::Mat ret;
-            cv::GaussianBlur(frame, ret, cv::Size(kernel_sz, kernel_sz), 0);
+            filter(frame, ret);
             cv::imshow("Gaussisan Blurring", ret);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(ret);
+            write_frame(output, ret);
         }
         output.release();
         return Video("videos/gaussian_blur.avi"); 
@@ -135,7 +305,7 @@ public:
 
     std::vector<cv::Point> collect_points(const std::string& window_name = "_tmp_collect")  {
         cv::Mat img; 
-        capture.read(img);
+        next_frame(img);
         std::vector<cv::Point> ret;
 
         cv::namedWindow(window_name, 1);
@@ -150,6 +320,7 @@ public:
     }
 
     Video create_homography(const std::vector<cv::Point>& points) {
+        IMGUTIL_TRACE_SPAN("Video::create_homography");
         debug_assert(points.size() == 4, "Exactly 4 points must be given");
 
         const std::vector<cv::Point> dst_points = {
@@ -159,21 +330,25 @@ public:
             cv::Point(0         , cap_height),
         };
         cv::Mat h = cv::findHomography(points, dst_points);
+        Warp warp;
 
         cv::VideoWriter output("videos/create_homography.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
         cv::Mat frame;
         std::cout << "Saving Perspective Shifted Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
+            // the matrix is fixed, so the remap tables are built once
+            if (warp.size() != frame.size())
+                warp = Warp(h, frame.size());
             cv::Mat ret;
-            cv::warpPerspective(frame, ret, h, frame.size());
+            warp.apply(frame, ret);
             cv::imshow("Shifting Perspective", ret);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 output.release();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(ret);
+            write_frame(output, ret);
         }
         output.release();
         return Video("videos/create_homography.avi"); 
@@ -181,38 +356,287 @@ public:
     }
 
     Video threshold(const int type, const int value) {
+        IMGUTIL_TRACE_SPAN("Video::threshold");
         debug_assert(type >= 1, "Threshold type must be at least 1");
-        debug_assert(type <= 5, "Threshold type must be at most 5");
+        debug_assert(type <= cv::THRESH_TOZERO_INV, "Threshold type must be at most 4");
         debug_assert(value >= 0, "Threshold value must be non-negative");
         debug_assert(value < 256, "Threshold value must be less than 256");
 
+        // fixed threshold through the engine, which fuses the gray
+        // conversion with the mapping and reuses its buffers across frames
+        ThresholdParams params;
+        params.mode = ThresholdMode::FIXED;
+        params.type = type;
+        params.value = value;
+        return threshold(params);
+    }
+    Video threshold(const ThresholdParams& params) {
+        IMGUTIL_TRACE_SPAN("Video::threshold");
+        ThresholdEngine engine(params);
+
         cv::VideoWriter output("videos/threshold.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
-        cv::Mat frame;
+        cv::Mat frame, ret;
         std::cout << "Saving Thresholded Video..." << std::endl;
-        while(capture.read(frame)){
-            cv::Mat gray_frame;
-            cv::cvtColor(frame, gray_frame, cv::COLOR_BGR2GRAY);
-            cv::Mat ret;
-            cv::threshold(gray_frame, ret, value, 255, type);
+        while(next_frame(frame)){
+            engine.apply(frame, ret);
             cv::imshow("Video Tresholding", ret);
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 output.release();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(ret);
+            write_frame(output, ret);
         }
         output.release();
         return Video("videos/threshold.avi"); 
+    }
+
+    // composite a still image onto every frame, with global or masked alpha,
+    // scaled into a rectangle or projected onto a quad; the overlay is
+    // prepared once so each frame costs one blend over the covered region
+    Video overlay(const cv::Mat& image, const OverlayParams& params = OverlayParams()) {
+        IMGUTIL_TRACE_SPAN("Video::overlay");
+        cv::VideoWriter output("videos/overlay.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
+        cv::Mat frame;
+        Compositor compositor;
+        std::cout << "Saving Overlaid Video..." << std::endl;
+        while(next_frame(frame)){
+            if (compositor.empty()) {
+                compositor = Compositor(params, image.size(), frame.size());
+                compositor.prepare(image);
+            }
+            compositor.apply(frame);
+            cv::imshow("Overlay", frame);
+            if (cv::waitKey(1) != -1){
+                release_capture();
+                output.release();
+                std::cout << "finished by user\n";
+                break;
+            }
+            write_frame(output, frame);
+        }
+        output.release();
+        return Video("videos/overlay.avi");
+    }
+
+    // picture-in-picture: composite the frames of other onto the frames of
+    // this video, frame by frame; when other ends its last frame stays up
+    Video overlay(Video& other, const OverlayParams& params = OverlayParams()) {
+        IMGUTIL_TRACE_SPAN("Video::overlay");
+        cv::VideoWriter output("videos/picture_in_picture.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
+        cv::Mat frame, inset;
+        bool inset_live = true;
+        Compositor compositor;
+        std::cout << "Saving Picture-in-Picture Video..." << std::endl;
+        while(next_frame(frame)){
+            if (inset_live && !other.next_frame(inset)) {
+                inset_live = false;
+                other.release_capture();
+            }
+            if (!inset.empty()) {
+                // the placement and warp tables depend only on the sizes
+                if (compositor.empty())
+                    compositor = Compositor(params, inset.size(), frame.size());
+                if (inset_live) compositor.prepare(inset);
+                compositor.apply(frame);
+            }
+            cv::imshow("Picture in Picture", frame);
+            if (cv::waitKey(1) != -1){
+                release_capture();
+                output.release();
+                std::cout << "finished by user\n";
+                break;
+            }
+            write_frame(output, frame);
+        }
+        output.release();
+        return Video("videos/picture_in_picture.avi");
+    }
 
-    } 
+private:
+
+    // filter frames [begin, end) of cap into output, seeking first unless
+    // cap is already at begin; frames past the end of the file, and the
+    // rest of the range after an error, are delivered as skipped
+    static void process_range(
+        cv::VideoCapture& cap, int& position, FrameFilter& filter,
+        const int begin, const int end, OrderedWriter& output) {
+        IMGUTIL_TRACE_SPAN("Video::process_range");
+        int f = begin;
+        try {
+            if (position != begin) cap.set(cv::CAP_PROP_POS_FRAMES, begin);
+            position = begin;
+            cv::Mat frame;
+            for (; f < end && cap.read(frame); ++f) {
+                ++position;
+                cv::Mat ret;
+                filter(frame, ret);
+                output.put(f, ret);
+            }
+        } catch (...) {
+            for (; f < end; ++f) output.put(f, cv::Mat());
+            position = -1;
+            throw;
+        }
+        for (; f < end; ++f) output.put(f, cv::Mat());
+    }
+
+public:
+
+    // Process the whole file with filter on n_segments threads of the
+    // shared executor (0 = all of them), as batch work. The file is split
+    // into ranges of one gop, or 16 frames when gop is 0, which the threads
+    // take in order; pass the source's keyframe interval as gop so ranges
+    // start on keyframes and seeking does not decode ahead. Filtered frames
+    // go through a reorder buffer of 16 frames per thread straight to a
+    // single encoder. Streams and containers that report no frame count are
+    // processed in one pass.
+    Video process_segments(
+        const FrameFilter& filter,
+        const std::string& filename = "videos/segments.avi",
+        int n_segments = 0,
+        const int gop = 0) {
+        IMGUTIL_TRACE_SPAN("Video::process_segments");
+        debug_assert(!source.empty(), "Segment processing needs a video opened from a file");
+
+        const int total = capture.get(cv::CAP_PROP_FRAME_COUNT);
+        double fps = capture.get(cv::CAP_PROP_FPS);
+        if (fps <= 0) fps = 30;
+        Executor& executor = shared_executor();
+
+        std::cout << "Saving Segmented Video..." << std::endl;
+        if (total <= 0) {
+            // unknown length, nothing to split
+            cv::VideoCapture cap(source);
+            if (!cap.isOpened()) throw FailedToLoadImgErr{};
+            FrameFilter f = filter;
+            cv::VideoWriter output;
+            cv::Mat frame, ret;
+            while (cap.read(frame)) {
+                f(frame, ret);
+                if (!output.isOpened())
+                    output.open(filename, cv::VideoWriter::fourcc('M','J','P','G'), fps, ret.size(), ret.channels() == 3);
+                write_frame(output, ret);
+            }
+            output.release();
+            return Video(filename);
+        }
+
+        // ranges stay short whatever the thread count, and the reorder
+        // buffer holds a fixed number of frames per thread; a thread more
+        // than that ahead of the writer waits for it
+        const int length = gop > 0 ? gop : 16;
+        const int frames_per_thread = 16;
+        const int segments = (total + length - 1) / length;
+        const int threads = std::min(segments, n_segments > 0 ? n_segments : executor.concurrency());
+
+        OrderedWriter output(filename, fps, size_t(threads) * frames_per_thread);
+        std::atomic<int> next_segment{0};
+        std::vector<std::exception_ptr> errors(threads);
+
+        // one loop per thread, each claiming the lowest unclaimed range so
+        // the frame the writer waits for is always being worked on
+        executor.parallel_for(cv::Range(0, threads), [&](const cv::Range& r) {
+            for (int t = r.start; t < r.end; ++t) {
+                // every loop gets its own capture and copy of the filter
+                cv::VideoCapture cap(source);
+                FrameFilter f = filter;
+                int position = 0;
+                for (int s; (s = next_segment.fetch_add(1)) < segments;) {
+                    const int begin = s * length;
+                    const int end = std::min(total, begin + length);
+                    if (!cap.isOpened()) {
+                        if (!errors[t]) errors[t] = std::make_exception_ptr(FailedToLoadImgErr{});
+                        // keep the sequence complete so the writer drains
+                        for (int i = begin; i < end; ++i) output.put(i, cv::Mat());
+                        continue;
+                    }
+                    try {
+                        process_range(cap, position, f, begin, end, output);
+                    } catch (...) {
+                        if (!errors[t]) errors[t] = std::current_exception();
+                    }
+                }
+            }
+        }, Lane::BATCH);
+        output.release();
+        for (const std::exception_ptr& err : errors)
+            if (err) std::rethrow_exception(err);
+        return Video(filename);
+    }
+
+    // Run filter on a live source in real time. Capture runs ahead on its own
+    // thread and only the newest frame is ever processed; a frame older than
+    // budget_ms by the time it would be processed is skipped. pace_fps > 0
+    // replays a file at that rate for testing. Returns the capture-to-output
+    // latency of the frames that were written.
+    LatencyStats live(
+        const FrameFilter& filter,
+        const double budget_ms,
+        const std::string& filename = "videos/live.avi",
+        const double pace_fps = 0) {
+        IMGUTIL_TRACE_SPAN("Video::live");
+        using Clock = FrameReader::Clock;
+        // the filter's parallel loops go ahead of queued batch work
+        LaneScope lane(Lane::LATENCY);
+
+        // capture is the reader thread's once read_ahead starts
+        double fps = capture.get(cv::CAP_PROP_FPS);
+        if (fps <= 0) fps = 30;
+        read_ahead(2, ReaderPolicy::DROP_OLDEST, pace_fps);
+        FrameFilter f = filter;
+
+        cv::VideoWriter output;
+        LatencyStats stats;
+        std::vector<double> latencies;
+
+        cv::Mat frame, ret;
+        Clock::time_point stamp;
+        std::cout << "Saving Live Video..." << std::endl;
+        while (reader->read_latest(frame, &stamp)) {
+            const double age_ms = std::chrono::duration<double, std::milli>(Clock::now() - stamp).count();
+            if (age_ms > budget_ms) {
+                ++stats.stale;
+                continue;
+            }
+
+            f(frame, ret);
+            if (!output.isOpened())
+                output.open(filename, cv::VideoWriter::fourcc('M','J','P','G'), fps, ret.size(), ret.channels() == 3);
+            write_frame(output, ret);
+            latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - stamp).count());
+
+            cv::imshow("Live", ret);
+            if (cv::waitKey(1) != -1){
+                std::cout << "finished by user\n";
+                break;
+            }
+        }
+        stats.dropped = reader->dropped_frames();
+        release_capture();
+        output.release();
+
+        stats.processed = latencies.size();
+        if (!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            double sum = 0;
+            for (const double l : latencies) sum += l;
+            stats.mean_ms = sum / latencies.size();
+            stats.p50_ms = latencies[latencies.size() / 2];
+            stats.p95_ms = latencies[std::min(latencies.size() - 1, latencies.size() * 95 / 100)];
+            stats.max_ms = latencies.back();
+        }
+        std::cout << "Live: " << stats << "\n";
+        return stats;
+    }
 
     Video track(){
+        IMGUTIL_TRACE_SPAN("Video::track");
         cv::Ptr<cv::TrackerKCF> tracker = cv::TrackerKCF::create();
 
         cv::Mat frame;
-        capture.read(frame);
+        next_frame(frame);
 
         cv::Rect box;
         box = cv::selectROI(frame, false);
@@ -226,7 +650,7 @@ public:
         int total_frames = 0;
         float fps = -1;
         std::cout << "Saving Tracked Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
 
             frame_count++;
             total_frames++;
@@ -251,135 +675,23 @@ public:
             imshow("Tracking", frame);
 
             if (cv::waitKey(1) != -1){
-                capture.release();
+                release_capture();
                 output.release();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(frame);
+            write_frame(output, frame);
         }
         output.release();
         return Video("videos/tracker.avi"); 
 
     }
 
-private:
-
-    struct Detection{
-        int labelId;
-        float confidence;
-        cv::Rect box;
-    };
-
-    std::vector<std::string> loadClassifications(){
-        std::vector<std::string> classes;
-        std::ifstream ifs("model/classes.txt");
-        std::string line;
-        while (getline(ifs, line)){
-            classes.push_back(line);
-        }    
-        return classes;
-    }
-
-    cv::dnn::Net loadDNN(){
-        cv::dnn::Net nn; nn = cv::dnn::readNet("model/yolov5s.onnx");
-        nn.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
-        nn.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
-        return nn;
-    }
-
-    cv::Mat formatInput(cv::Mat &image){
-        int row = image.rows; 
-        int col = image.cols;
-        int sides = MAX(col, row);
-        cv::Mat input; input = cv::Mat::zeros(sides, sides, CV_8UC3);
-        image.copyTo(input(cv::Rect(0,0,col,row)));
-        return input;
-    }
-
-    std::vector<Detection> obtainOutput(cv::dnn::Net &net, cv::Mat &input, const std::vector<std::string> labels){
-        const float INPUT_SIDES = 640.0;
-        const float SCORE_THRESHOLD = 0.2;
-        const float NMS_THRESHOLD = 0.4;
-        const float CONFIDENCE_THRESHOLD = 0.4;
-
-        cv::Mat blob;
-        cv::dnn::blobFromImage(input, blob, 1./255., cv::Size(INPUT_SIDES, INPUT_SIDES), cv::Scalar(), true, false);
-        net.setInput(blob);
-
-        std::vector<cv::Mat> outputs;
-        net.forward(outputs, net.getUnconnectedOutLayersNames());
-        
-        // Scaling factor from input image to blob input
-        float x_factor = input.cols / INPUT_SIDES;
-        float y_factor = input.rows / INPUT_SIDES;
-        // extract detection data
-        float *data = (float *)outputs[0].data;
-
-        std::vector<int> labelIds;
-        std::vector<float> confidences;
-        std::vector<cv::Rect> boxes;
-        const int ROWS = 25200;
-        for (int i = 0; i < ROWS; ++i) {
-
-            float confidence = data[4];
-            if (confidence >= CONFIDENCE_THRESHOLD) {
-
-                float * label_scores = data + 5;
-                cv::Mat scores(1, labels.size(), CV_32FC1, label_scores);
-                cv::Point labelId;
-                double max_label_score;
-                minMaxLoc(scores, 0, &max_label_score, 0, &labelId);
-                if (max_label_score > SCORE_THRESHOLD) {
-                    float x = data[0];
-                    float y = data[1];
-                    float w = data[2];
-                    float h = data[3];
-                    int left = int((x - 0.5 * w) * x_factor);
-                    int top = int((y - 0.5 * h) * y_factor);
-                    int width = int(w * x_factor);
-                    int height = int(h * y_factor);
-
-                    boxes.push_back(cv::Rect(left, top, width, height));
-                    confidences.push_back(confidence);
-                    labelIds.push_back(labelId.x);
-                }
-            }
-            data += 85;
-        }
-
-        // suppress overlapping boxes/detections with Non-maximal supression
-        std::vector<Detection> output;
-        std::vector<int> nms_result;
-        cv::dnn::NMSBoxes(boxes, confidences, SCORE_THRESHOLD, NMS_THRESHOLD, nms_result);
-        for (int i = 0; i < nms_result.size(); i++) {
-            int idx = nms_result[i];
-            Detection result;
-            result.labelId = labelIds[idx];
-            result.confidence = confidences[idx];
-            result.box = boxes[idx];
-            output.push_back(result);
-        }
-        return output;
-    }
-
-    void putDetection(std::vector<Detection> &output, cv::Mat &frame, const std::vector<std::string> labels){
-        const std::vector<cv::Scalar> colors = {cv::Scalar(255, 255, 0), cv::Scalar(0, 255, 0), cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 0)};
-        for (int i = 0; i < output.size(); ++i){
-                auto detection = output[i];
-                auto box = detection.box;
-                auto labelId = detection.labelId;
-                const auto color = colors[labelId % colors.size()];
-                cv::rectangle(frame, box, color, 3);
-                cv::rectangle(frame, cv::Point(box.x, box.y - 20), cv::Point(box.x + box.width, box.y), color, cv::FILLED);
-                cv::putText(frame, labels[labelId].c_str(), cv::Point(box.x, box.y - 5), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 0));
-            }
-    }
-
-public:
-    Video detection(){
-        std::vector<std::string> label = Video::loadClassifications();
-        cv::dnn::Net net = Video::loadDNN();
+    Video detection(const DetectorParams& params = DetectorParams()){
+        IMGUTIL_TRACE_SPAN("Video::detection");
+        // the preloaded detector is leased per frame, so Image::detection
+        // and servers sharing it are not shut out for the whole video
+        const DetectorHandle handle(params);
 
         cv::VideoWriter output("videos/detect.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(cap_width,cap_height));
         auto start = std::chrono::high_resolution_clock::now();
@@ -387,31 +699,69 @@ public:
         int total_frames = 0;
         float fps = -1;
         
+        // with tiling on, a frame with no changed tile reuses the last detections
+        DirtyTiles changes(tiling.value_or(TileParams()));
+        MotionGate gate(motion_gating.value_or(MotionParams()));
+        std::vector<Detection> detections; 
+
         cv::Mat frame;
-        capture.read(frame);
+        next_frame(frame);
         std::cout << "Saving Detected Video..." << std::endl;
-        while(capture.read(frame)){
+        while(next_frame(frame)){
 
             frame_count++;
             total_frames++;
-            
-            cv::Mat input; 
-            input = Video::formatInput(frame);
 
-            std::vector<Detection> detections; 
-            detections = Video::obtainOutput(net, input, label);
+            // no motion, or with tiling no changed tile, keeps the last detections
+            std::vector<cv::Rect> regions;
+            bool changed = true;
+            if (motion_gating) {
+                regions = gate.update(frame);
+                changed = !regions.empty();
+            } else if (tiling) {
+                changes.update(frame);
+                changed = changes.count() > 0;
+            }
 
-            Video::putDetection(detections, frame, label); 
+            {
+                const DetectorLease lease = handle.lease();
+                Detector& detector = *lease;
+                if (changed && motion_gating) {
+                    // only the moving regions go through the net, in one
+                    // batch; detections elsewhere are still there, detections
+                    // inside a region are replaced by what the net now sees
+                    std::vector<cv::Mat> crops;
+                    for (const cv::Rect& region : regions) crops.push_back(frame(region));
+                    const std::vector<std::vector<Detection>> found = detector.detect_batch(crops);
+
+                    std::vector<Detection> kept;
+                    for (const Detection& d : detections) {
+                        const bool moved = std::any_of(regions.begin(), regions.end(),
+                            [&](const cv::Rect& region) { return (d.box & region).area() > 0; });
+                        if (!moved) kept.push_back(d);
+                    }
+                    for (size_t i = 0; i < regions.size(); ++i) {
+                        for (Detection d : found[i]) {
+                            d.box += regions[i].tl();
+                            kept.push_back(d);
+                        }
+                    }
+                    detections = std::move(kept);
+                } else if (changed) {
+                    detections = detector.detect(frame);
+                }
+                detector.draw(detections, frame);
+            }
 
             imshow("Tracking", frame);
 
             if (cv::waitKey(1) != -1){
                 output.release();
-                capture.release();
+                release_capture();
                 std::cout << "finished by user\n";
                 break;
             }
-            output.write(frame);
+            write_frame(output, frame);
         }
         output.release();
         return Video("videos/detect.avi"); 
@@ -0,0 +1,166 @@
+//
+// Precomputed perspective warps and a cache of them
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Executor.h"
+
+
+// A perspective warp with the per-pixel inverse mapping precomputed as
+// fixed-point remap tables. Applying it to a frame is a single remap, so
+// warping every frame of a video with the same matrix skips the per-pixel
+// projection that cv::warpPerspective redoes on each call.
+class Warp {
+
+    cv::Mat map1;       // CV_16SC2 integer source coordinates
+    cv::Mat map2;       // CV_16UC1 interpolation table indices, empty for INTER_NEAREST
+    cv::Size dst_size;
+    int interpolation = cv::INTER_LINEAR;
+
+public:
+
+    Warp() = default;
+    // h maps source pixels to destination pixels, as for cv::warpPerspective
+    Warp(const cv::Mat& h, const cv::Size& _dst_size, const int _interpolation = cv::INTER_LINEAR)
+        : dst_size(_dst_size), interpolation(_interpolation) {
+        CV_Assert(interpolation == cv::INTER_NEAREST || interpolation == cv::INTER_LINEAR || interpolation == cv::INTER_CUBIC);
+
+        cv::Mat h_inv;
+        cv::invert(h, h_inv);
+        h_inv.convertTo(h_inv, CV_64F);
+        const cv::Matx33d m = h_inv;
+
+        cv::Mat map_x(dst_size, CV_32FC1), map_y(dst_size, CV_32FC1);
+        shared_executor().parallel_for(cv::Range(0, dst_size.height), [&](const cv::Range& range) {
+            for (int y = range.start; y < range.end; ++y) {
+                float* mx = map_x.ptr<float>(y);
+                float* my = map_y.ptr<float>(y);
+                for (int x = 0; x < dst_size.width; ++x) {
+                    const double w = m(2, 0) * x + m(2, 1) * y + m(2, 2);
+                    if (w == 0) {
+                        mx[x] = my[x] = -1.f;
+                        continue;
+                    }
+                    const double iw = 1.0 / w;
+                    mx[x] = float((m(0, 0) * x + m(0, 1) * y + m(0, 2)) * iw);
+                    my[x] = float((m(1, 0) * x + m(1, 1) * y + m(1, 2)) * iw);
+                }
+            }
+        });
+        cv::convertMaps(map_x, map_y, map1, map2, CV_16SC2, interpolation == cv::INTER_NEAREST);
+    }
+
+    // homography taking src_points onto dst_points
+    static Warp from_points(
+        const std::vector<cv::Point>& src_points,
+        const std::vector<cv::Point>& dst_points,
+        const cv::Size& dst_size) {
+        return Warp(cv::findHomography(src_points, dst_points), dst_size);
+    }
+
+    const cv::Size& size() const { return dst_size; }
+    bool empty() const { return map1.empty(); }
+
+    // warp src into dst, in parallel strips of destination rows
+    void apply(const cv::Mat& src, cv::Mat& dst) const {
+        CV_Assert(!empty());
+        if (dst.data == src.data) {
+            cv::Mat tmp;
+            apply(src, tmp);
+            dst = tmp;
+            return;
+        }
+
+        dst.create(dst_size, src.type());
+        shared_executor().parallel_for(cv::Range(0, dst_size.height), [&](const cv::Range& range) {
+            cv::Mat strip = dst.rowRange(range);
+            cv::remap(
+                src,
+                strip,
+                map1.rowRange(range),
+                map2.empty() ? cv::Mat() : map2.rowRange(range),
+                interpolation,
+                cv::BORDER_CONSTANT
+            );
+        });
+    }
+};
+
+// Small least-recently-used cache of warps keyed by their point sets and
+// output size, so stills warped with the same points reuse the tables.
+class WarpCache {
+
+    using Key = std::vector<int>;
+    using Entry = std::pair<Key, std::shared_ptr<const Warp>>;
+
+    size_t capacity;
+    std::list<Entry> entries;   // most recently used first
+    std::map<Key, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+
+    static Key make_key(
+        const std::vector<cv::Point>& src_points,
+        const std::vector<cv::Point>& dst_points,
+        const cv::Size& dst_size) {
+        Key key = {dst_size.width, dst_size.height, int(src_points.size())};
+        for (const cv::Point& p : src_points) { key.push_back(p.x); key.push_back(p.y); }
+        for (const cv::Point& p : dst_points) { key.push_back(p.x); key.push_back(p.y); }
+        return key;
+    }
+
+public:
+
+    WarpCache(const size_t _capacity = 8) : capacity(_capacity) {}
+
+    std::shared_ptr<const Warp> get(
+        const std::vector<cv::Point>& src_points,
+        const std::vector<cv::Point>& dst_points,
+        const cv::Size& dst_size) {
+        const Key key = make_key(src_points, dst_points, dst_size);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                entries.splice(entries.begin(), entries, it->second);
+                return it->second->second;
+            }
+        }
+
+        // build outside of the lock, the tables take a full pass over dst_size
+        auto warp = std::make_shared<const Warp>(Warp::from_points(src_points, dst_points, dst_size));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+            return it->second->second;
+
+        entries.emplace_front(key, warp);
+        index[key] = entries.begin();
+        while (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return warp;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+    }
+};
+
+// process-wide cache used by Image::create_homography
+inline WarpCache& shared_warp_cache() {
+    static WarpCache cache;
+    return cache;
+}
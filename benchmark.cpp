@@ -1,8 +1,18 @@
 
 #include <chrono>
+#include <thread>
+#include <cstdlib>
 #include "Image.h"
 #include "Video.h"
 
+// run one benchmark inside an allocation scope of its own, reported at the
+// end of main when the counting allocator is installed
+template <typename F>
+void accounted(const char* name, F benchmark){
+    AllocationScope scope(name);
+    benchmark();
+}
+
 // IMAGE BENCHMARKS
 
 
@@ -36,6 +46,41 @@ void alpha_blend_benchmark(const int ITERATIONS){
      std::cout  << "Alpha Blend (average time, ms): " << (totalTime/float(ITERATIONS))/1000.0 << std::endl;
 }
 
+//  benchmark fitting the same overlay to a frame, with and without the resize cache
+void fit_to_size_benchmark(const int ITERATIONS){
+    Image img1 = Image("sp500.png");
+    const Image img2 = Image("times-square.png");
+    for (const bool cache : {false, true}) {
+        ResizeParams params;
+        params.cache = cache;
+        auto totalTime = 0;
+        for(int i=0; i<ITERATIONS; i++){
+            Image overlay = img2;
+            auto start = std::chrono::high_resolution_clock::now();
+            overlay.fit_to_size(img1, params);
+            auto end = std::chrono::high_resolution_clock::now();
+            auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+            totalTime += time.count();
+        }
+        std::cout  << "Fit to size, cache " << (cache ? "on" : "off") << " (average time, ms): " << (totalTime/float(ITERATIONS))/1000.0 << std::endl;
+    }
+}
+
+//  benchmark compositing an overlay at an offset, no resize beforehand
+void overlay_benchmark(const int ITERATIONS){
+    Image img1 = Image("sp500.png");
+    Image img2 = Image("times-square.png");
+    auto totalTime = 0;
+    for(int i=0; i<ITERATIONS; i++){
+        auto start = std::chrono::high_resolution_clock::now();
+        img1.overlay(img2, cv::Point(40, 40), 0.7);
+        auto end = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        totalTime += time.count();
+    }
+     std::cout  << "Overlay (average time, ms): " << (totalTime/float(ITERATIONS))/1000.0 << std::endl;
+}
+
 //  benchmark image detection for given set of thresholds
 void edge_detect_benchmark(const int ITERATIONS){
     Image img1 = Image("sp500.png");
@@ -68,6 +113,82 @@ void gaussian_blur_benchmark(const int ITERATIONS){
      std::cout  << "Gaussian Blurring, (average time, ms):  " << (totalTime/float(ITERATIONS))/1000.0 << "\n";
 }
 
+//  benchmark a large blur at full resolution and on pyramid level 2, which is
+//      built on the first call and reused afterwards
+void pyramid_blur_benchmark(const int ITERATIONS){
+    Image img1 = Image("sp500.png");
+    const int KERNEL_SZ = 61;
+    for (const int level : {0, 2}) {
+        auto totalTime = 0;
+        for(int i=0; i<ITERATIONS; i++){
+            auto start = std::chrono::high_resolution_clock::now();
+            img1.gaussian_blur(KERNEL_SZ, level);
+            auto end = std::chrono::high_resolution_clock::now();
+            auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+            totalTime += time.count();
+        }
+        std::cout  << "Gaussian Blurring " << KERNEL_SZ << ", level " << level << " (average time, ms):  " << (totalTime/float(ITERATIONS))/1000.0 << "\n";
+    }
+}
+
+//  benchmark grayscale and threshold on a thumbnail, where the typed kernels
+//      replace OpenCV's per-call dispatch
+void small_image_benchmark(const int ITERATIONS){
+    Image img1 = Image("sp500.png").resize(cv::Size(128, 128));
+    auto totalTime = 0;
+    for(int i=0; i<ITERATIONS; i++){
+        auto start = std::chrono::high_resolution_clock::now();
+        img1.grayscale().threshold(cv::THRESH_TOZERO, 128);
+        auto end = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        totalTime += time.count();
+    }
+     std::cout  << "Thumbnail grayscale + threshold (average time, ms):  " << (totalTime/float(ITERATIONS))/1000.0 << "\n";
+}
+
+//  benchmark every CPU level the host supports on the dispatched kernels:
+//      masked overlay blending and NMS over overlapping boxes
+void cpu_level_benchmark(const int ITERATIONS){
+    Image img1 = Image("sp500.png");
+    Image img2 = Image("times-square.png");
+    // small enough for the typed threshold kernel rather than cv::threshold
+    const Image small = img1.resize(cv::Size(256, 256));
+    std::vector<cv::Rect> boxes;
+    std::vector<float> scores;
+    std::vector<int> class_ids;
+    cv::RNG rng(42);
+    for (int i = 0; i < 2000; ++i) {
+        boxes.push_back(cv::Rect(rng.uniform(0, 600), rng.uniform(0, 600), rng.uniform(10, 80), rng.uniform(10, 80)));
+        scores.push_back(rng.uniform(0.f, 1.f));
+        class_ids.push_back(rng.uniform(0, 4));
+    }
+
+    const CpuLevel active = cpu_level();
+    std::cout << "CPU level detected: " << cpu_level_name(detected_cpu_level()) << ", active: " << cpu_level_name(active) << "\n";
+    for (const CpuLevel level : supported_cpu_levels()) {
+        set_cpu_level(level);
+        auto blendTime = 0;
+        auto nmsTime = 0;
+        auto thresholdTime = 0;
+        for(int i=0; i<ITERATIONS; i++){
+            auto start = std::chrono::high_resolution_clock::now();
+            img1.overlay(img2, cv::Point(40, 40), 0.7);
+            auto mid = std::chrono::high_resolution_clock::now();
+            nms(boxes, scores, class_ids);
+            auto end = std::chrono::high_resolution_clock::now();
+            small.threshold(cv::THRESH_BINARY, 127);
+            auto last = std::chrono::high_resolution_clock::now();
+            blendTime += std::chrono::duration_cast<std::chrono::microseconds>(mid - start).count();
+            nmsTime += std::chrono::duration_cast<std::chrono::microseconds>(end - mid).count();
+            thresholdTime += std::chrono::duration_cast<std::chrono::microseconds>(last - end).count();
+        }
+        std::cout << "  " << cpu_level_name(level) << ": overlay " << (blendTime/float(ITERATIONS))/1000.0
+                  << " ms, nms " << (nmsTime/float(ITERATIONS))/1000.0
+                  << " ms, threshold " << (thresholdTime/float(ITERATIONS))/1000.0 << " ms\n";
+    }
+    set_cpu_level(active);
+}
+
 //  benchmark homography perspective for pre-collected vector of points
 void create_homography_benchmark(const int ITERATIONS){
     
@@ -106,6 +227,23 @@ void threshold_benchmark(const int ITERATIONS){
 }
 
 
+// benchmark Otsu thresholding, histogram fused into the grayscale pass
+void otsu_threshold_benchmark(const int ITERATIONS){
+    Image img = Image("sp500.png");
+    ThresholdParams params;
+    params.mode = ThresholdMode::OTSU;
+    auto totalTime = 0;
+    for(int i=0; i<ITERATIONS; i++){
+        auto start = std::chrono::high_resolution_clock::now();
+        img.threshold(params); 
+        auto end = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        totalTime += time.count();
+    }
+     std::cout  << "Otsu Threshold (average time, ms):  " << (totalTime/float(ITERATIONS))/1000.0 << "\n";
+}
+
+
 void grayscale_benchmark(const int ITERATIONS){
     Image img = Image("sp500.png");
     auto totalTime = 0;
@@ -120,6 +258,19 @@ void grayscale_benchmark(const int ITERATIONS){
 }
 
 
+// preload and warm up the default detector, report its start-up costs
+void preload_benchmark(){
+    Image img = Image("sp500.png");
+    auto detector = preload_detector();
+    img.detection();
+    const DetectorMetrics& m = detector->metrics();
+    std::cout << "Detector load (ms): " << m.load_ms
+              << ", warm-up (ms): " << m.warm_up_ms
+              << ", ready (ms): " << m.ready_ms
+              << ", first detection (ms): " << m.first_detection_ms << "\n";
+}
+
+
 void detection_benchmark(const int ITERATIONS){
     Image img = Image("sp500.png");
     auto totalTime = 0;
@@ -134,6 +285,37 @@ void detection_benchmark(const int ITERATIONS){
 }
 
 
+// detection from several client threads sharing one batching InferenceServer
+void server_detection_benchmark(const int CLIENTS, const int ITERATIONS){
+    Image img = Image("sp500.png");
+    InferenceServer server;
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> clients;
+    for(int c=0; c<CLIENTS; c++){
+        clients.emplace_back([&]{
+            for(int i=0; i<ITERATIONS; i++)
+                img.detection(server);
+        });
+    }
+    for(auto& client : clients) client.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout  << "Server detection throughput (images/s): " << CLIENTS * ITERATIONS / (time.count() / 1e6) << "\n";
+}
+
+// time every available DNN backend/target/thread configuration on this host
+void dnn_config_benchmark(){
+    std::cout << "DNN configurations (median forward time):\n";
+    const DnnConfig best = pick_fastest_dnn_config("model/yolov5s.onnx");
+    std::cout << "Fastest DNN configuration: " << best.name() << "\n";
+    if (best.threads >= 0)
+        std::cout << "  use it with IMGUTIL_DNN_THREADS=" << best.threads << "\n";
+    // the executor backend reports its full size, not the startup cap, so
+    // restoring cv::getNumThreads() lifts the cap; put it back
+    DnnConfig::from_env().apply_threads();
+}
+
+
 // VIDEO BENCHMARKS
 
 void video_edge_detection_benchmark(){
@@ -171,19 +353,85 @@ void video_threshold_benchmark(){
 
 }
 
+// same edge detection as above, with decoding overlapped by a read-ahead thread
+void video_read_ahead_benchmark(){
+
+    Video video = Video("sample.mp4");
+    video.read_ahead(8);
+    auto start = std::chrono::high_resolution_clock::now();
+    video.edge_detect(100, 200);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto time = std::chrono::duration_cast<std::chrono::seconds> (end - start);
+    std::cout << "Video read-ahead edge detection execution time (s): " << time.count() << "\n";
+
+}
+
+// same edge detection as above, split into one segment per executor thread
+void video_segments_benchmark(){
+
+    Video video = Video("sample.mp4");
+    auto start = std::chrono::high_resolution_clock::now();
+    video.process_segments(edge_detect_filter(100, 200));
+    auto end = std::chrono::high_resolution_clock::now();
+    auto time = std::chrono::duration_cast<std::chrono::seconds> (end - start);
+    std::cout << "Video segmented edge detection execution time (s): " << time.count() << "\n";
+
+}
+
 int main() {
 
+    // with spans compiled in (-DIMGUTIL_TRACE), IMGUTIL_TRACE_FILE=trace.json
+    // records the whole run for chrome://tracing or ui.perfetto.dev
+    const char* trace_file = std::getenv("IMGUTIL_TRACE_FILE");
+    if (trace_file) start_tracing();
+
+    // IMGUTIL_ALLOC_STATS=1 counts the cv::Mat allocations of every
+    // benchmark, IMGUTIL_ALLOC_STATS=pool also recycles buffers by size class
+    const char* alloc_stats = std::getenv("IMGUTIL_ALLOC_STATS");
+    if (alloc_stats) {
+        AllocatorParams params;
+        params.pool = std::string(alloc_stats) == "pool";
+        install_counting_allocator(params);
+    }
+
+    // IMGUTIL_THREADS=n sizes the pool every parallel path shares,
+    // IMGUTIL_PIN=1 pins its workers to cores
+    Executor& executor = configure_executor(ExecutorParams::from_env());
+    std::cout << "Executor: " << executor.size() << " workers\n";
+    // IMGUTIL_DNN_THREADS=n caps the threads one parallel loop uses
+    DnnConfig::from_env().apply_threads();
+
     // image runtime benchmarks over number of iterations  
-    load_benchmark(500);
-    edge_detect_benchmark(1000);
-    gaussian_blur_benchmark(1000);
-    alpha_blend_benchmark(1000);
-    create_homography_benchmark(1000);
+    accounted("load", [] { load_benchmark(500); });
+    accounted("edge_detect", [] { edge_detect_benchmark(1000); });
+    accounted("gaussian_blur", [] { gaussian_blur_benchmark(1000); });
+    accounted("alpha_blend", [] { alpha_blend_benchmark(1000); });
+    accounted("overlay", [] { overlay_benchmark(1000); });
+    accounted("fit_to_size", [] { fit_to_size_benchmark(1000); });
+    accounted("pyramid_blur", [] { pyramid_blur_benchmark(100); });
+    accounted("small_image", [] { small_image_benchmark(10000); });
+    accounted("cpu_level", [] { cpu_level_benchmark(200); });
+    accounted("create_homography", [] { create_homography_benchmark(1000); });
+    accounted("otsu_threshold", [] { otsu_threshold_benchmark(1000); });
+    accounted("dnn_config", [] { dnn_config_benchmark(); });
+    accounted("preload", [] { preload_benchmark(); });
+    accounted("server_detection", [] { server_detection_benchmark(8, 10); });
     
     // video benchmarks 
-    video_edge_detection_benchmark();
-    video_gaussian_blur_benchmark();
-    video_threshold_benchmark();
+    accounted("video_edge_detection", [] { video_edge_detection_benchmark(); });
+    accounted("video_gaussian_blur", [] { video_gaussian_blur_benchmark(); });
+    accounted("video_threshold", [] { video_threshold_benchmark(); });
+    accounted("video_read_ahead", [] { video_read_ahead_benchmark(); });
+    accounted("video_segments", [] { video_segments_benchmark(); });
+
+    if (CountingAllocator* allocator = counting_allocator()) {
+        for (const auto& [name, stats] : allocator->report())
+            std::cout << "Allocations, " << name << ": " << stats << "\n";
+        std::cout << "Allocations, total: " << allocator->totals() << "\n";
+    }
+
+    if (trace_file && !stop_tracing(trace_file))
+        std::cerr << "could not write " << trace_file << std::endl;
 
 
     return 0;
@@ -0,0 +1,132 @@
+//
+// Regression checks for the Image & Video libraries, run with make img_tests
+//
+
+#include <iostream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cmath>
+
+#include "Image.h"
+#include "Video.h"
+
+
+static int failures = 0;
+
+static void check(const bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static bool same_pixels(const cv::Mat& a, const cv::Mat& b) {
+    return a.size() == b.size() && a.type() == b.type() && cv::norm(a, b, cv::NORM_INF) == 0;
+}
+
+// a source rewritten in place must not resize to its old contents
+static void resize_after_in_place_write() {
+    cv::Mat src(64, 64, CV_8UC3, cv::Scalar(10, 20, 30));
+    const Image image(src);
+    const cv::Mat before = image.resize(cv::Size(32, 32)).mat().clone();
+
+    src.setTo(cv::Scalar(200, 100, 50));
+    const cv::Mat after = image.resize(cv::Size(32, 32)).mat();
+    check(!same_pixels(before, after), "resize after the source was rewritten in place");
+    check(after.at<cv::Vec3b>(0, 0) == cv::Vec3b(200, 100, 50), "resize sees the new contents");
+}
+
+// frames come back once each and in order, whatever thread filtered them
+static void segments_keep_frame_order() {
+    const std::string source = "videos/_test_segments_in.avi";
+    const std::string result = "videos/_test_segments_out.avi";
+    const int frames = 40;
+    cv::VideoWriter writer(source, cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(64, 48));
+    for (int i = 0; i < frames; ++i) writer.write(cv::Mat(48, 64, CV_8UC3, cv::Scalar::all(i * 6)));
+    writer.release();
+
+    Video(source).process_segments(grayscale_filter(), result, 8);
+
+    cv::VideoCapture out(result);
+    cv::Mat frame;
+    int count = 0;
+    double previous = -1;
+    bool ordered = true;
+    while (out.read(frame)) {
+        const double value = cv::mean(frame)[0];
+        ordered = ordered && value > previous;
+        previous = value;
+        ++count;
+    }
+    check(count == frames, "every segment frame written once");
+    check(ordered, "segment frames written in order");
+    std::remove(source.c_str());
+    std::remove(result.c_str());
+}
+
+// a blur wider than the default halo, recomputed only where the frame
+// changed, matches blurring the whole frame
+static void tiled_blur_matches_untiled() {
+    const int kernel_sz = 41;
+    cv::Mat first(256, 256, CV_8UC3);
+    cv::randu(first, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat second = first.clone();
+    second(cv::Rect(70, 70, 40, 40)).setTo(cv::Scalar::all(255));
+
+    FrameFilter tiled = tiled_filter(gaussian_blur_filter(kernel_sz), TileParams(), kernel_sz / 2);
+    cv::Mat out, expected;
+    tiled(first, out);
+    tiled(second, out);
+    gaussian_blur_filter(kernel_sz)(second, expected);
+    check(same_pixels(out, expected), "tiled blur matches the untiled blur");
+}
+
+// pyramid levels follow writes made through mutable_mat()
+static void pyramid_after_in_place_write() {
+    Image image(cv::Mat(64, 64, CV_8UC3, cv::Scalar::all(10)));
+    const cv::Mat before = image.pyramid_level(1).mat().clone();
+    image.mutable_mat().setTo(cv::Scalar::all(200));
+    const cv::Mat after = image.pyramid_level(1).mat();
+    check(!same_pixels(before, after), "pyramid level after an in-place write");
+}
+
+// writes through a wrapped cv::Mat reach the pyramid once it is reset
+static void pyramid_after_external_write() {
+    cv::Mat pixels(64, 64, CV_8UC3, cv::Scalar::all(10));
+    Image image(pixels);
+    const cv::Mat before = image.pyramid_level(1).mat().clone();
+    pixels.setTo(cv::Scalar::all(200));
+    image.reset_pyramid();
+    const cv::Mat after = image.pyramid_level(1).mat();
+    check(!same_pixels(before, after), "pyramid level after reset_pyramid");
+}
+
+// depths the fixed-point engine does not take still blend, through OpenCV
+static void alpha_blend_other_depths() {
+    for (const int type : {CV_16UC3, CV_32FC3}) {
+        const Image a(cv::Mat(300, 300, type, cv::Scalar::all(100)));
+        const Image b(cv::Mat(300, 300, type, cv::Scalar::all(200)));
+        const cv::Mat blended = a.alpha_blend(b, 0.25).mat();
+        check(blended.type() == type && std::abs(cv::mean(blended)[0] - 125) < 1e-3,
+              "alpha_blend of type " + std::to_string(type));
+    }
+}
+
+int main() {
+    const std::vector<std::pair<std::string, std::function<void()>>> tests = {
+        {"resize_after_in_place_write", resize_after_in_place_write},
+        {"segments_keep_frame_order", segments_keep_frame_order},
+        {"tiled_blur_matches_untiled", tiled_blur_matches_untiled},
+        {"pyramid_after_in_place_write", pyramid_after_in_place_write},
+        {"pyramid_after_external_write", pyramid_after_external_write},
+        {"alpha_blend_other_depths", alpha_blend_other_depths},
+    };
+    for (const auto& [name, test] : tests) {
+        std::cout << name << "\n";
+        test();
+    }
+    std::cout << (failures ? "FAILED: " + std::to_string(failures) : std::string("all passed")) << "\n";
+    return failures ? 1 : 0;
+}
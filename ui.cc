@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <chrono>
+#include <cstdlib>
 
 #include "Image.h"
 #include "Video.h"
@@ -97,6 +98,10 @@ static Image get_object_features(const Image& img_in) {
 
     const auto area = img_in.get_0th_moment(pts);
     cout << "Area: " <<  area << "\n";
+
+    const auto stats = img_in.region_stats(pts);
+    cout << "Mean colour (BGR): (" << stats.mean_color[0] << ", " << stats.mean_color[1] << ", " << stats.mean_color[2] << ")\n";
+    cout << "Orientation (rad): " << stats.orientation() << "\n";
     
     return mask;
 }
@@ -119,12 +124,35 @@ static void threshold_options(){
     cout << "3: Truncated Threshold\n";
     cout << "4: Threshold to Zero\n";
     cout << "5: Inverted Threshold to Zero\n";
+    cout << "6: Otsu Binary Threshold\n";
+    cout << "7: Triangle Binary Threshold\n";
+    cout << "8: Adaptive Mean Threshold\n";
+    cout << "9: Adaptive Gaussian Threshold\n";
+}
+
+// options 6-9 select a ThresholdEngine mode instead of a fixed value
+static bool is_engine_threshold(const int type) { return type >= 6 && type <= 9; }
+
+static ThresholdParams get_threshold_params(const int type) {
+    ThresholdParams params;
+    params.type = cv::THRESH_BINARY;
+    switch (type) {
+    case 6: params.mode = ThresholdMode::OTSU; break;
+    case 7: params.mode = ThresholdMode::TRIANGLE; break;
+    case 8: params.mode = ThresholdMode::ADAPTIVE_MEAN; break;
+    case 9: params.mode = ThresholdMode::ADAPTIVE_GAUSSIAN; break;
+    }
+    if (type >= 8)
+        params.block_size = get_val_from_user<int>("window size (odd)");
+    return params;
 }
 
 static Image threshold_mask(const Image& img_in) {
 
     threshold_options();
     const int type = get_val_from_user<int>("threshold type");
+    if (is_engine_threshold(type))
+        return img_in.threshold(get_threshold_params(type));
     const int val = get_val_from_user<int>("threshold value");
 
     return img_in.threshold(type, val);
@@ -162,6 +190,8 @@ static Video threshold_mask(Video& cap_in) {
 
     threshold_options();
     const int type = get_val_from_user<int>("threshold type");
+    if (is_engine_threshold(type))
+        return cap_in.threshold(get_threshold_params(type));
     const int val = get_val_from_user<int>("threshold value");
 
     return cap_in.threshold(type, val);
@@ -172,6 +202,15 @@ static Video grayscale(Video & cap_in){
     return cap_in.grayscale();
 }
 
+static void live_edge_detect(Video& cap_in){
+    const int lower_threshold = get_val_from_user<int>("lower threshold");
+    const int upper_threshold = get_val_from_user<int>("upper threshold");
+    const double budget_ms = get_val_from_user<double>("latency budget (ms)");
+
+    // replay the file at 30 fps as if it were a camera
+    cap_in.live(edge_detect_filter(lower_threshold, upper_threshold), budget_ms, "videos/live.avi", 30);
+}
+
 static Video tracking(Video& cap_in){
 
     return cap_in.track();
@@ -352,6 +391,7 @@ static void print_video_menu(){
     cout << "\t6: grayscale\n";
     cout << "\tT: track\n";
     cout << "\tD: detect\n";
+    cout << "\tL: live edge detect\n";
     cout << "\t0: exit\n";
     cout << "$ ";
 }
@@ -388,12 +428,25 @@ static void video_cases(){
         case 'D':
             cap = detection(cap);
             break;
+        case 'L':
+            live_edge_detect(cap);
+            break;
         }
     }  while (opt != '0');
 }
 
 int main() {
 
+    // one pool for the library's loops and OpenCV's, sized from IMGUTIL_THREADS
+    configure_executor();
+    // IMGUTIL_DNN_THREADS=n, e.g. the count dnn benchmarking picked
+    DnnConfig::from_env().apply_threads();
+
+    // in a tracing build (make img_runner_traced), IMGUTIL_TRACE_FILE=trace.json
+    // records the session
+    const char* trace_file = std::getenv("IMGUTIL_TRACE_FILE");
+    if (trace_file) start_tracing();
+
     print_header();
     print_main_menu();
     char opt;
@@ -408,5 +461,6 @@ int main() {
         break;
     }
 
-    
+    if (trace_file && !stop_tracing(trace_file))
+        cerr << "could not write " << trace_file << std::endl;
 }
\ No newline at end of file